@@ -0,0 +1,134 @@
+/*
+ * win32yang - Clipboard tool for Windows
+ * Last Change:  2026 Oct 18
+ * License:      https://unlicense.org
+ * URL:          https://github.com/matveyt/win32yang
+ */
+
+
+// clipboard broadcast ring (--publish, --follow): RING_HEADER followed by RING_SIZE bytes
+// of records, each RING_RECORD + text (WCHARs) padded to RING_ALIGN; record positions
+// only grow (modulo 2^32), so RING_SIZE must be a power of two
+//
+// no system calls here: the includer provides WCHAR, MemoryBarrier(), mem_copy() and
+// heap_alloc(), and maps the ring into every process (test/ring_test.c does it on POSIX)
+#if !defined(RING_H)
+#define RING_H
+
+#define RING_MAGIC 0x31525957   // "WYR1"
+#if !defined(RING_SIZE)
+#define RING_SIZE (8 << 20)
+#endif // RING_SIZE
+#define RING_ALIGN 16
+#define RING_MAX_CCH (RING_SIZE / 8)    // longer text is not copied to the ring
+#define RING_POLL 100                   // ms to sleep if a wakeup is missed
+#define RING_STEP(cch) \
+    ((sizeof(RING_RECORD) + sizeof(WCHAR) * (cch) + RING_ALIGN - 1) & ~(RING_ALIGN - 1))
+typedef struct {
+    uint32_t magic;
+    uint32_t size;              // RING_SIZE
+    volatile uint32_t seq;      // number of the last record
+    volatile uint32_t last;     // position of the last record
+    volatile uint32_t head;     // position past the last record
+    volatile uint32_t reserve;  // position past the record being written
+    uint32_t reserved[2];
+} RING_HEADER;
+typedef struct {
+    uint32_t seq;       // record number
+    uint32_t cch;       // WCHARs following (0 if the text was too long)
+    uint32_t cchText;   // WCHARs in the clipboard
+    uint32_t clipSeq;   // clipboard sequence number of the text
+} RING_RECORD;
+
+
+static void mem_copy(void* pDst, const void* pSrc, size_t sz);
+static void* heap_alloc(void* ptr, size_t sz);
+static void ring_init(RING_HEADER* pr);
+static void ring_append(RING_HEADER* pr, const WCHAR* pw, size_t cch, uint32_t clipSeq);
+static bool ring_next(const RING_HEADER* pr, uint32_t* ppos, RING_RECORD* prec, WCHAR** ppw);
+static void ring_put(RING_HEADER* pr, uint32_t pos, const void* ptr, size_t sz);
+static void ring_get(const RING_HEADER* pr, uint32_t pos, void* ptr, size_t sz);
+
+
+// empty ring unless it is one of ours already
+// readers of a ring left by the previous writer go on
+void ring_init(RING_HEADER* pr)
+{
+    if (pr->magic != RING_MAGIC || pr->size != RING_SIZE) {
+        pr->size = RING_SIZE;
+        pr->seq = pr->last = pr->head = pr->reserve = 0;
+        MemoryBarrier();
+        pr->magic = RING_MAGIC;
+    }
+}
+
+
+// text => next ring record (a single writer only)
+// readers may not trust data below reserve - RING_SIZE
+void ring_append(RING_HEADER* pr, const WCHAR* pw, size_t cch, uint32_t clipSeq)
+{
+    RING_RECORD rec = { pr->seq + 1, (cch <= RING_MAX_CCH) ? (uint32_t)cch : 0,
+        (uint32_t)cch, clipSeq };
+    uint32_t pos = pr->head, end = pos + (uint32_t)RING_STEP(rec.cch);
+
+    pr->reserve = end;
+    MemoryBarrier();
+    ring_put(pr, pos, &rec, sizeof(rec));
+    ring_put(pr, pos + sizeof(rec), pw, sizeof(WCHAR) * rec.cch);
+    MemoryBarrier();
+    pr->seq = rec.seq;
+    pr->last = pos;
+    pr->head = end;
+}
+
+
+// ring record at *ppos => *prec and *ppw (heap)
+// returns false if there is nothing new
+// a record overwritten while it was read is dropped for the last one
+bool ring_next(const RING_HEADER* pr, uint32_t* ppos, RING_RECORD* prec, WCHAR** ppw)
+{
+    for (;;) {
+        uint32_t pos = *ppos;
+        if (pos == pr->head)
+            return false;
+        MemoryBarrier();
+        ring_get(pr, pos, prec, sizeof(*prec));
+        bool valid = prec->cch <= RING_MAX_CCH;
+        if (valid) {
+            *ppw = heap_alloc(*ppw, sizeof(WCHAR) * prec->cch + 1);
+            ring_get(pr, pos + sizeof(*prec), *ppw, sizeof(WCHAR) * prec->cch);
+        }
+        MemoryBarrier();
+        if (valid && pr->reserve - pos <= RING_SIZE) {
+            *ppos = pos + (uint32_t)RING_STEP(prec->cch);
+            return true;
+        }
+        *ppos = pr->last;
+    }
+}
+
+
+// ptr => ring at pos (wraps around)
+void ring_put(RING_HEADER* pr, uint32_t pos, const void* ptr, size_t sz)
+{
+    uint8_t* pData = (uint8_t*)(pr + 1);
+    size_t off = pos % RING_SIZE, n = RING_SIZE - off;
+    if (n > sz)
+        n = sz;
+    mem_copy(pData + off, ptr, n);
+    mem_copy(pData, (const uint8_t*)ptr + n, sz - n);
+}
+
+
+// ring at pos => ptr (wraps around)
+void ring_get(const RING_HEADER* pr, uint32_t pos, void* ptr, size_t sz)
+{
+    const uint8_t* pData = (const uint8_t*)(pr + 1);
+    size_t off = pos % RING_SIZE, n = RING_SIZE - off;
+    if (n > sz)
+        n = sz;
+    mem_copy(ptr, pData + off, n);
+    mem_copy((uint8_t*)ptr + n, pData, sz - n);
+}
+
+#endif // RING_H
@@ -0,0 +1,184 @@
+/*
+ * nfc_test - --nfc against the Unicode normalization tests (POSIX, ICU)
+ * License:   https://unlicense.org
+ *
+ * Every line of NormalizationTest.txt goes through wcs_nfc(), as with -i --nfc, and all
+ * of them, one per line, through a --nfc sink, as with -o, -c and --follow, fed in chunks
+ * of several sizes to cover spans split between sink_write() calls. NFC(c1) = NFC(c2) =
+ * NFC(c3) = c2 and NFC(c4) = NFC(c5) = c4 must hold.
+ *
+ * The shim maps NormalizeString() to ICU, so the file should be of the same Unicode
+ * version as the ICU library, e.g. https://www.unicode.org/Public/15.0.0/ucd/ for ICU 72.
+ * The test is skipped if the file is missing.
+ *
+ * usage: nfc_test [NormalizationTest.txt]
+ */
+
+
+// win32yang.c as is, but for its entry point
+#define wmain win32yang_main
+#include "../win32yang.c"
+#undef wmain
+#include <stdio.h>
+#include <stdlib.h>
+
+
+#define MAX_LINE 1024
+
+
+typedef struct {
+    WCHAR* pw;
+    size_t cch;
+    size_t cchMax;
+} TEXT;
+
+
+static bool text_parse(TEXT* pt, const char* psz, const char** ppszEnd);
+static void text_add(TEXT* pt, const WCHAR* pw, size_t cch);
+static bool test_global(const WCHAR* pw, size_t cch, const WCHAR* pwNFC, size_t cchNFC);
+static size_t test_sink(const TEXT* pIn, const TEXT* pNFC, size_t cchChunk);
+
+
+int wmain(int argc, wchar_t* argv[])
+{
+    char szPath[4 * MAX_PATH] = "NormalizationTest.txt";
+    if (argc > 1)
+        WideCharToMultiByte(CP_UTF8, 0, argv[1], -1, szPath, sizeof(szPath), NULL, NULL);
+    FILE* f = fopen(szPath, "r");
+    if (f == NULL) {
+        printf("SKIP: no %s\n", szPath);
+        return 0;
+    }
+    if (!IsNormalizedString(NormalizationC, L"\u00C5", 1)
+        || IsNormalizedString(NormalizationC, L"A\u030A", 2)) {
+        printf("SKIP: NormalizeString() is not supported (build with ICU)\n");
+        fclose(f);
+        return 0;
+    }
+
+    // all fields one per line, expected NFC one per line
+    TEXT in = { NULL, 0, 0 }, nfc = { NULL, 0, 0 };
+    char szLine[MAX_LINE];
+    unsigned nLines = 0, nFailed = 0, line = 0;
+    while (fgets(szLine, sizeof(szLine), f) != NULL) {
+        ++line;
+        if (szLine[0] == '#' || szLine[0] == '@' || szLine[0] == '\n')
+            continue;
+
+        TEXT c[5] = { { NULL, 0, 0 } };
+        const char* psz = szLine;
+        bool ok = true;
+        for (int i = 0; i < 5 && ok; ++i)
+            ok = text_parse(&c[i], psz, &psz);
+        if (!ok) {
+            fprintf(stderr, "line %u: bad format\n", line);
+            return 2;
+        }
+
+        for (int i = 0; i < 5; ++i) {
+            const TEXT* pExp = &c[(i < 3) ? 1 : 3];
+            if (!test_global(c[i].pw, c[i].cch, pExp->pw, pExp->cch)) {
+                if (nFailed++ < 20)
+                    fprintf(stderr, "line %u: wcs_nfc(c%d) != c%d\n", line, i + 1,
+                        (i < 3) ? 2 : 4);
+            }
+            static const WCHAR wcLF = '\n';
+            text_add(&in, c[i].pw, c[i].cch);
+            text_add(&in, &wcLF, 1);
+            text_add(&nfc, pExp->pw, pExp->cch);
+            text_add(&nfc, &wcLF, 1);
+            heap_free(c[i].pw);
+        }
+        ++nLines;
+    }
+    fclose(f);
+
+    // a line feed stops any composition or reordering, so lines are independent
+    static const size_t cchChunk[] = { 1, 2, 3, 5, 16, 1000, SINK_CCH - 1, SINK_CCH + 1,
+        3 * SINK_CCH };
+    for (size_t i = 0; i < sizeof(cchChunk) / sizeof(cchChunk[0]); ++i) {
+        size_t off = test_sink(&in, &nfc, cchChunk[i]);
+        if (off < nfc.cch) {
+            ++nFailed;
+            line = 1;
+            for (size_t k = 0; k < off; ++k)
+                line += nfc.pw[k] == '\n';
+            fprintf(stderr, "sink (%zu WCHARs a chunk): differs at %zu, test field %u\n",
+                cchChunk[i], off, line);
+        }
+    }
+
+    heap_free(in.pw);
+    heap_free(nfc.pw);
+    printf("%s: %u lines, %u failures\n", nFailed ? "FAIL" : "PASS", nLines, nFailed);
+    return nFailed != 0;
+}
+
+
+// "XXXX XXXX;" => *pt (heap), *ppszEnd past ';'
+bool text_parse(TEXT* pt, const char* psz, const char** ppszEnd)
+{
+    for (;;) {
+        char* pszEnd;
+        unsigned long c = strtoul(psz, &pszEnd, 16);
+        if (pszEnd == psz || c > 0x10FFFF)
+            return false;
+        WCHAR w[2] = { (WCHAR)c, 0 };
+        if (c >= 0x10000) {
+            w[0] = (WCHAR)(0xD800 + ((c - 0x10000) >> 10));
+            w[1] = (WCHAR)(0xDC00 + (c & 0x3FF));
+        }
+        text_add(pt, w, (c >= 0x10000) ? 2 : 1);
+        psz = pszEnd;
+        if (*psz == ';') {
+            *ppszEnd = psz + 1;
+            return true;
+        }
+    }
+}
+
+
+// append WCHARs to text
+void text_add(TEXT* pt, const WCHAR* pw, size_t cch)
+{
+    if (pt->cch + cch > pt->cchMax) {
+        pt->cchMax = (pt->cch + cch) * 2;
+        pt->pw = heap_alloc(pt->pw, sizeof(WCHAR) * pt->cchMax);
+    }
+    mem_copy(pt->pw + pt->cch, pw, sizeof(WCHAR) * cch);
+    pt->cch += cch;
+}
+
+
+// wcs_nfc(pw) == pwNFC
+bool test_global(const WCHAR* pw, size_t cch, const WCHAR* pwNFC, size_t cchNFC)
+{
+    HANDLE hUCS = NULL;
+    WCHAR* pwG = global_alloc(&hUCS, sizeof(WCHAR) * (cch + 1));
+    mem_copy(pwG, pw, sizeof(WCHAR) * cch);
+    pwG[cch] = 0;
+    GlobalUnlock(hUCS);
+
+    hUCS = wcs_nfc(hUCS);
+    pwG = GlobalLock(hUCS);
+    bool same = wcs_trim(pwG, GlobalSize(hUCS) / sizeof(WCHAR)) == cchNFC
+        && mem_mismatch(pwG, pwNFC, sizeof(WCHAR) * cchNFC) == sizeof(WCHAR) * cchNFC;
+    GlobalUnlock(hUCS);
+    global_free(hUCS);
+    return same;
+}
+
+
+// --nfc sink fed by cchChunk WCHARs <=> pNFC
+// returns offset of the first difference or pNFC->cch if none
+size_t test_sink(const TEXT* pIn, const TEXT* pNFC, size_t cchChunk)
+{
+    SINK k;
+    sink_open(&k, NULL, CP_UTF16, false, true);
+    k.pwCmp = pNFC->pw;
+    k.cchCmp = pNFC->cch;
+    for (size_t i = 0; i < pIn->cch && !k.diff; i += cchChunk)
+        sink_write(&k, pIn->pw + i, (pIn->cch - i < cchChunk) ? pIn->cch - i : cchChunk);
+    sink_close(&k);
+    return (k.diff || k.offCmp < pNFC->cch) ? k.offCmp : pNFC->cch;
+}
@@ -0,0 +1,202 @@
+/*
+ * ring_test - multi-process stress test of the --publish/--follow ring (POSIX)
+ * License:    https://unlicense.org
+ *
+ * One writer appends records of every length, most of them longer than a reader can
+ * keep up with, to a small ring shared by fork(); readers, some of them slow enough to be
+ * lapped, check that every record they get is whole and that sequence numbers only grow.
+ * Positions start just below 2^32 to cover the wrap around.
+ *
+ * usage: ring_test [readers] [records]
+ */
+
+
+#define _DEFAULT_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+// what ring.h expects from win32yang.c
+typedef uint16_t WCHAR;
+#define MemoryBarrier() __sync_synchronize()
+#define RING_SIZE 4096
+#include "../ring.h"
+
+
+typedef struct {
+    volatile uint32_t done;     // writer has finished
+    RING_HEADER ring;           // followed by RING_SIZE bytes
+} SHARED;
+
+typedef struct {
+    uint32_t nRecords;          // records read
+    uint32_t nDropped;          // records lapped over
+    uint32_t nLong;             // records without text
+} RESULT;
+
+
+static uint32_t text_len(uint32_t seq);
+static WCHAR text_at(uint32_t seq, uint32_t i);
+static void writer(SHARED* ps, uint32_t count);
+static int reader(SHARED* ps, uint32_t count, unsigned id, RESULT* pres);
+
+
+int main(int argc, char* argv[])
+{
+    unsigned nReaders = (argc > 1) ? (unsigned)atoi(argv[1]) : 4;
+    uint32_t count = (argc > 2) ? (uint32_t)atol(argv[2]) : 200000;
+    if (nReaders < 1 || nReaders > 64 || count < 1) {
+        fprintf(stderr, "usage: ring_test [readers (1-64)] [records]\n");
+        return 2;
+    }
+
+    SHARED* ps = mmap(NULL, sizeof(SHARED) + RING_SIZE, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    RESULT* pres = mmap(NULL, sizeof(RESULT) * nReaders, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ps == MAP_FAILED || pres == MAP_FAILED) {
+        perror("mmap");
+        return 2;
+    }
+    ring_init(&ps->ring);
+    ps->ring.last = ps->ring.head = ps->ring.reserve = UINT32_MAX - RING_SIZE / 2;
+
+    // readers start from the current head like --follow does
+    for (unsigned i = 0; i < nReaders; ++i) {
+        pid_t pid = fork();
+        if (pid == 0)
+            _exit(reader(ps, count, i, &pres[i]));
+        if (pid < 0) {
+            perror("fork");
+            return 2;
+        }
+    }
+    usleep(10000);
+    writer(ps, count);
+
+    int ret = 0, status;
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            ret = 1;
+    }
+    for (unsigned i = 0; i < nReaders; ++i) {
+        printf("reader %u: %u records, %u lapped over, %u without text\n", i,
+            pres[i].nRecords, pres[i].nDropped, pres[i].nLong);
+    }
+    printf("%s: %u records, %u readers, head at %u\n", ret ? "FAIL" : "PASS", count,
+        nReaders, ps->ring.head);
+    return ret;
+}
+
+
+// text length of a record: 0 to past RING_MAX_CCH
+uint32_t text_len(uint32_t seq)
+{
+    return (seq * 2654435761u >> 7) % (RING_MAX_CCH + RING_MAX_CCH / 8);
+}
+
+
+// text of a record
+WCHAR text_at(uint32_t seq, uint32_t i)
+{
+    return (WCHAR)(seq * 31 + i * 7);
+}
+
+
+// records 1 to count => ring
+void writer(SHARED* ps, uint32_t count)
+{
+    WCHAR* pw = malloc(sizeof(WCHAR) * (RING_MAX_CCH + RING_MAX_CCH / 8));
+
+    for (uint32_t seq = 1; seq <= count; ++seq) {
+        uint32_t cch = text_len(seq);
+        for (uint32_t i = 0; i < cch; ++i)
+            pw[i] = text_at(seq, i);
+        ring_append(&ps->ring, pw, cch, seq);
+        // short pauses let fast readers keep up; slow ones still fall behind
+        if (seq % 4 == 0)
+            usleep(1);
+    }
+    MemoryBarrier();
+    ps->done = 1;
+    free(pw);
+}
+
+
+// ring => checks until the last record or the writer is done
+// returns 0 if every record is whole and in order
+int reader(SHARED* ps, uint32_t count, unsigned id, RESULT* pres)
+{
+    uint32_t pos = ps->ring.head, seqLast = 0;
+    RING_RECORD rec;
+    WCHAR* pw = NULL;
+    memset(pres, 0, sizeof(*pres));
+
+    for (;;) {
+        bool done = ps->done;
+        MemoryBarrier();
+        if (!ring_next(&ps->ring, &pos, &rec, &pw)) {
+            if (done)
+                break;
+            sched_yield();
+            continue;
+        }
+
+        // odd readers are slow and get lapped
+        if (id % 2 != 0 && rec.seq % 64 == 0)
+            usleep(200);
+
+        // too long text is recorded without it
+        uint32_t cch = text_len(rec.seq);
+        bool whole = rec.cch == cch || (rec.cch == 0 && cch > RING_MAX_CCH);
+        if (rec.seq <= seqLast || rec.seq > count || rec.clipSeq != rec.seq
+            || rec.cchText != cch || !whole) {
+            fprintf(stderr, "reader %u: bad record %u after %u (cch %u, text %u, clip %u)\n",
+                id, rec.seq, seqLast, rec.cch, rec.cchText, rec.clipSeq);
+            return 1;
+        }
+        for (uint32_t i = 0; i < rec.cch; ++i) {
+            if (pw[i] != text_at(rec.seq, i)) {
+                fprintf(stderr, "reader %u: record %u torn at %u of %u\n", id, rec.seq,
+                    i, rec.cch);
+                return 1;
+            }
+        }
+
+        pres->nDropped += rec.seq - seqLast - 1;
+        pres->nLong += rec.cch < rec.cchText;
+        ++pres->nRecords;
+        seqLast = rec.seq;
+        if (seqLast == count)
+            break;
+    }
+
+    free(pw);
+    if (seqLast != count) {
+        fprintf(stderr, "reader %u: stopped at %u of %u\n", id, seqLast, count);
+        return 1;
+    }
+    return 0;
+}
+
+
+// what ring.h expects from win32yang.c
+static void mem_copy(void* pDst, const void* pSrc, size_t sz)
+{
+    memcpy(pDst, pSrc, sz);
+}
+
+static void* heap_alloc(void* ptr, size_t sz)
+{
+    void* p = realloc(ptr, sz);
+    if (p == NULL)
+        abort();
+    return p;
+}
@@ -0,0 +1,1169 @@
+/*
+ * shim.c - the part of Win32 used by win32yang, on POSIX (tests only)
+ * License: https://unlicense.org
+ *
+ * Good enough to run win32yang.c unchanged in shell tests, not a Win32 emulator:
+ *  - the clipboard is a file ($WIN32YANG_CLIPBOARD, default $TMPDIR/win32yang-clipboard)
+ *    replaced atomically on every change; its first word is the sequence number and
+ *    OpenClipboard() locks it, so processes sharing the file share a clipboard
+ *  - a clipboard listener polls the sequence number from GetMessage()
+ *  - named mappings and mutexes are files in $WIN32YANG_SHIM_DIR (default $TMPDIR);
+ *    named events never fire, waiting for one just sleeps a little
+ *  - CP_ACP and CP_OEMCP are Latin-1
+ *  - NormalizeString() is ICU if built with -DHAVE_ICU, otherwise --nfc does nothing
+ */
+
+
+#define _DEFAULT_SOURCE
+#include <stdbool.h>
+#include "windows.h"
+#include "tchar.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(HAVE_ICU)
+#include <unicode/unorm2.h>
+#endif // HAVE_ICU
+
+
+enum { SH_FILE, SH_MAPPING, SH_MUTEX, SH_EVENT, SH_THREAD };
+typedef struct {
+    int type;           // SH_xxx
+    int fd;             // -1 if none
+    uint64_t size;      // SH_MAPPING
+} SHIM_HANDLE;
+
+typedef struct {
+    size_t sz;
+    uint8_t* pb;
+} SHIM_GLOBAL;
+
+#define CLIP_MAX 64
+#define QUEUE_MAX 256
+#define VIEW_MAX 16
+
+
+static DWORD dwLastError;
+static SHIM_HANDLE hStd[3] = { { SH_FILE, 0, 0 }, { SH_FILE, 1, 0 }, { SH_FILE, 2, 0 } };
+static struct {
+    void* ptr;
+    size_t sz;
+} views[VIEW_MAX];
+static struct {
+    int fdLock;             // -1 if closed
+    bool dirty;
+    uint32_t seq;
+    UINT n;
+    UINT fmt[CLIP_MAX];
+    SHIM_GLOBAL* h[CLIP_MAX];
+} clip = { -1, false, 0, 0, {0}, {0} };
+static char names[CLIP_MAX][256];  // registered clipboard formats (0xC000 + i)
+static UINT nNames;
+static struct {
+    pthread_mutex_t lock;
+    bool listening;
+    DWORD dwSeq;            // last sequence number seen by the listener
+    MSG msg[QUEUE_MAX];
+    size_t head, tail;
+} queue = { PTHREAD_MUTEX_INITIALIZER, false, 0, {{0}}, 0, 0 };
+
+
+static const char* path_utf8(LPCWSTR psz);
+static const char* clip_path(void);
+static const char* shim_path(LPCWSTR pszName);
+static bool clip_read(const char* pszPath, uint32_t* pseq, UINT fmtWant);
+static void clip_drop(void);
+static HANDLE handle_new(int type, int fd);
+static void sleep_ms(DWORD ms);
+static bool msg_poll(MSG* pMsg, bool remove);
+
+
+// POSIX entry point => wmain() with UTF-16 arguments
+int main(int argc, char* argv[])
+{
+    signal(SIGPIPE, SIG_IGN);
+    wchar_t** wargv = calloc((size_t)argc + 1, sizeof(wchar_t*));
+    for (int i = 0; i < argc; ++i) {
+        int cb = (int)strlen(argv[i]) + 1;
+        wargv[i] = calloc((size_t)cb, sizeof(wchar_t));
+        MultiByteToWideChar(CP_UTF8, 0, argv[i], cb, wargv[i], cb);
+    }
+    return wmain(argc, wargv);
+}
+
+
+//
+// strings and code pages
+//
+
+int lstrcmpW(LPCWSTR psz1, LPCWSTR psz2)
+{
+    while (*psz1 != 0 && *psz1 == *psz2)
+        ++psz1, ++psz2;
+    return (int)*psz1 - (int)*psz2;
+}
+
+int lstrlenW(LPCWSTR psz)
+{
+    int n = 0;
+    while (psz[n] != 0)
+        ++n;
+    return n;
+}
+
+UINT GetACP(void)
+{
+    return 1252;
+}
+
+UINT GetOEMCP(void)
+{
+    return 437;
+}
+
+BOOL GetCPInfo(UINT cp, CPINFO* pInfo)
+{
+    memset(pInfo, 0, sizeof(*pInfo));
+    pInfo->MaxCharSize = (cp == CP_UTF8) ? 4 : 1;
+    pInfo->DefaultChar[0] = '?';
+    return TRUE;
+}
+
+BOOL IsDBCSLeadByteEx(UINT cp, BYTE b)
+{
+    (void)cp;
+    (void)b;
+    return FALSE;
+}
+
+// UTF-8 or Latin-1 => UTF-16; invalid UTF-8 bytes become U+FFFD
+int MultiByteToWideChar(UINT cp, DWORD flags, LPCSTR pIn, int cbIn, LPWSTR pOut,
+    int cchOut)
+{
+    const uint8_t* pb = (const uint8_t*)pIn;
+    size_t sz = (cbIn < 0) ? strlen(pIn) + 1 : (size_t)cbIn;
+    int cch = 0;
+    (void)flags;
+
+    for (size_t i = 0; i < sz; ) {
+        uint32_t c = pb[i++];
+        if (cp == CP_UTF8 && c >= 0x80) {
+            size_t n = (c >= 0xF0 && c < 0xF5) ? 3 : (c >= 0xE0) ? 2 : (c >= 0xC2) ? 1 : 0;
+            uint32_t min = (n == 3) ? 0x10000 : (n == 2) ? 0x800 : 0x80;
+            uint32_t u = c & (0x3F >> n);
+            size_t k = 0;
+            while (k < n && i + k < sz && (pb[i + k] & 0xC0) == 0x80)
+                u = (u << 6) | (pb[i + k++] & 0x3F);
+            if (n == 0 || k < n || u < min || u > 0x10FFFF || (u >= 0xD800 && u < 0xE000)) {
+                c = 0xFFFD;
+                i += (k < n) ? k : 0;
+            } else {
+                c = u;
+                i += k;
+            }
+        }
+        int cchChar = (c >= 0x10000) ? 2 : 1;
+        if (cchOut > 0) {
+            if (cch + cchChar > cchOut) {
+                dwLastError = ERROR_INSUFFICIENT_BUFFER;
+                return 0;
+            }
+            if (c >= 0x10000) {
+                pOut[cch] = (WCHAR)(0xD800 + ((c - 0x10000) >> 10));
+                pOut[cch + 1] = (WCHAR)(0xDC00 + (c & 0x3FF));
+            } else {
+                pOut[cch] = (WCHAR)c;
+            }
+        }
+        cch += cchChar;
+    }
+
+    return cch;
+}
+
+// UTF-16 => UTF-8 or Latin-1; lone surrogates become U+FFFD or '?'
+int WideCharToMultiByte(UINT cp, DWORD flags, LPCWSTR pIn, int cchIn, LPSTR pOut,
+    int cbOut, LPCSTR pDefault, BOOL* pUsed)
+{
+    size_t cch = (cchIn < 0) ? (size_t)lstrlenW(pIn) + 1 : (size_t)cchIn;
+    int cb = 0;
+    (void)flags;
+    (void)pDefault;
+
+    for (size_t i = 0; i < cch; ++i) {
+        uint32_t c = pIn[i];
+        if (c >= 0xD800 && c < 0xDC00 && i + 1 < cch && pIn[i + 1] >= 0xDC00
+            && pIn[i + 1] < 0xE000)
+            c = 0x10000 + ((c - 0xD800) << 10) + (pIn[++i] - 0xDC00);
+        else if (c >= 0xD800 && c < 0xE000)
+            c = 0xFFFD;
+
+        uint8_t buf[4];
+        int n;
+        if (cp != CP_UTF8) {
+            buf[0] = (c < 0x100) ? (uint8_t)c : '?';
+            if (c >= 0x100 && pUsed != NULL)
+                *pUsed = TRUE;
+            n = 1;
+        } else if (c < 0x80) {
+            buf[0] = (uint8_t)c;
+            n = 1;
+        } else if (c < 0x800) {
+            buf[0] = (uint8_t)(0xC0 | c >> 6);
+            buf[1] = (uint8_t)(0x80 | (c & 0x3F));
+            n = 2;
+        } else if (c < 0x10000) {
+            buf[0] = (uint8_t)(0xE0 | c >> 12);
+            buf[1] = (uint8_t)(0x80 | (c >> 6 & 0x3F));
+            buf[2] = (uint8_t)(0x80 | (c & 0x3F));
+            n = 3;
+        } else {
+            buf[0] = (uint8_t)(0xF0 | c >> 18);
+            buf[1] = (uint8_t)(0x80 | (c >> 12 & 0x3F));
+            buf[2] = (uint8_t)(0x80 | (c >> 6 & 0x3F));
+            buf[3] = (uint8_t)(0x80 | (c & 0x3F));
+            n = 4;
+        }
+        if (cbOut > 0) {
+            if (cb + n > cbOut) {
+                dwLastError = ERROR_INSUFFICIENT_BUFFER;
+                return 0;
+            }
+            memcpy(pOut + cb, buf, (size_t)n);
+        }
+        cb += n;
+    }
+
+    return cb;
+}
+
+#if defined(HAVE_ICU)
+// ICU normalizer for form or NULL
+static const UNormalizer2* norm_icu(NORM_FORM form)
+{
+    UErrorCode err = U_ZERO_ERROR;
+    const UNormalizer2* pNorm = (form == NormalizationC) ? unorm2_getNFCInstance(&err)
+        : (form == NormalizationD) ? unorm2_getNFDInstance(&err)
+        : (form == NormalizationKC) ? unorm2_getNFKCInstance(&err)
+        : (form == NormalizationKD) ? unorm2_getNFKDInstance(&err) : NULL;
+    return U_SUCCESS(err) ? pNorm : NULL;
+}
+
+// true if there is an unpaired surrogate (Windows fails on those, ICU does not)
+static bool norm_invalid(LPCWSTR pIn, int cchIn)
+{
+    for (int i = 0; i < cchIn; ++i) {
+        if ((pIn[i] & 0xFC00) == 0xD800 && i + 1 < cchIn && (pIn[i + 1] & 0xFC00) == 0xDC00)
+            ++i;
+        else if ((pIn[i] & 0xF800) == 0xD800)
+            return true;
+    }
+    return false;
+}
+
+int NormalizeString(NORM_FORM form, LPCWSTR pIn, int cchIn, LPWSTR pOut, int cchOut)
+{
+    const UNormalizer2* pNorm = norm_icu(form);
+    UErrorCode err = U_ZERO_ERROR;
+    if (cchIn < 0)
+        cchIn = lstrlenW(pIn) + 1;
+    if (pNorm == NULL || norm_invalid(pIn, cchIn)) {
+        dwLastError = (pNorm == NULL) ? ERROR_NOT_SUPPORTED : ERROR_NO_UNICODE_TRANSLATION;
+        return 0;
+    }
+
+    int n = unorm2_normalize(pNorm, (const UChar*)pIn, cchIn, (UChar*)pOut, cchOut, &err);
+    if (cchOut == 0 && err == U_BUFFER_OVERFLOW_ERROR)
+        return n;
+    if (U_FAILURE(err) || n > cchOut) {
+        dwLastError = (err == U_BUFFER_OVERFLOW_ERROR || n > cchOut)
+            ? ERROR_INSUFFICIENT_BUFFER : ERROR_NO_UNICODE_TRANSLATION;
+        return 0;
+    }
+    return n;
+}
+
+BOOL IsNormalizedString(NORM_FORM form, LPCWSTR pIn, int cchIn)
+{
+    const UNormalizer2* pNorm = norm_icu(form);
+    UErrorCode err = U_ZERO_ERROR;
+    if (cchIn < 0)
+        cchIn = lstrlenW(pIn) + 1;
+    if (pNorm == NULL || norm_invalid(pIn, cchIn))
+        return FALSE;
+    UBool ok = unorm2_isNormalized(pNorm, (const UChar*)pIn, cchIn, &err);
+    return U_SUCCESS(err) && ok;
+}
+#else
+// no normalization without a Unicode library: --nfc leaves text as is
+int NormalizeString(NORM_FORM form, LPCWSTR pIn, int cchIn, LPWSTR pOut, int cchOut)
+{
+    (void)form;
+    (void)pIn;
+    (void)cchIn;
+    (void)pOut;
+    (void)cchOut;
+    dwLastError = ERROR_NOT_SUPPORTED;
+    return 0;
+}
+
+BOOL IsNormalizedString(NORM_FORM form, LPCWSTR pIn, int cchIn)
+{
+    (void)form;
+    (void)pIn;
+    (void)cchIn;
+    return TRUE;
+}
+#endif // HAVE_ICU
+
+
+//
+// files
+//
+
+HANDLE GetStdHandle(DWORD n)
+{
+    return (n == STD_INPUT_HANDLE) ? &hStd[0] : (n == STD_OUTPUT_HANDLE) ? &hStd[1]
+        : &hStd[2];
+}
+
+DWORD GetFileType(HANDLE h)
+{
+    struct stat st;
+    if (fstat(((SHIM_HANDLE*)h)->fd, &st) != 0)
+        return FILE_TYPE_UNKNOWN;
+    return S_ISREG(st.st_mode) ? FILE_TYPE_DISK : S_ISFIFO(st.st_mode) ? FILE_TYPE_PIPE
+        : FILE_TYPE_CHAR;
+}
+
+HANDLE CreateFileW(LPCWSTR pszName, DWORD access, DWORD share, void* pSec, DWORD disp,
+    DWORD attr, HANDLE hTemplate)
+{
+    (void)share;
+    (void)pSec;
+    (void)attr;
+    (void)hTemplate;
+    const char* pszPath = path_utf8(pszName);
+    if (strcmp(pszPath, "NUL") == 0)
+        pszPath = "/dev/null";
+
+    int flags = (access & GENERIC_WRITE) ? ((access & GENERIC_READ) ? O_RDWR : O_WRONLY)
+        : (access & FILE_APPEND_DATA) ? (O_WRONLY | O_APPEND) : O_RDONLY;
+    if (disp == CREATE_ALWAYS)
+        flags |= O_CREAT | O_TRUNC;
+    else if (disp == OPEN_ALWAYS)
+        flags |= O_CREAT;
+    int fd = open(pszPath, flags, 0644);
+    if (fd < 0) {
+        dwLastError = ERROR_FILE_NOT_FOUND;
+        return INVALID_HANDLE_VALUE;
+    }
+    return handle_new(SH_FILE, fd);
+}
+
+BOOL ReadFile(HANDLE h, LPVOID ptr, DWORD cb, LPDWORD pcbRead, void* pOverlapped)
+{
+    ssize_t n;
+    (void)pOverlapped;
+    while ((n = read(((SHIM_HANDLE*)h)->fd, ptr, cb)) < 0 && errno == EINTR)
+        ;
+    *pcbRead = (n > 0) ? (DWORD)n : 0;
+    return n >= 0;
+}
+
+BOOL WriteFile(HANDLE h, LPCVOID ptr, DWORD cb, LPDWORD pcbWritten, void* pOverlapped)
+{
+    DWORD cbDone = 0;
+    (void)pOverlapped;
+    while (cbDone < cb) {
+        ssize_t n = write(((SHIM_HANDLE*)h)->fd, (const uint8_t*)ptr + cbDone, cb - cbDone);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            dwLastError = ERROR_BROKEN_PIPE;
+            break;
+        }
+        cbDone += (DWORD)n;
+    }
+    if (pcbWritten != NULL)
+        *pcbWritten = cbDone;
+    return cbDone == cb;
+}
+
+BOOL GetFileSizeEx(HANDLE h, LARGE_INTEGER* pSize)
+{
+    struct stat st;
+    if (fstat(((SHIM_HANDLE*)h)->fd, &st) != 0)
+        return FALSE;
+    pSize->QuadPart = st.st_size;
+    return TRUE;
+}
+
+BOOL CloseHandle(HANDLE h)
+{
+    SHIM_HANDLE* ph = h;
+    if (ph->fd >= 0)
+        close(ph->fd);
+    ph->fd = -1;
+    if (ph < hStd || ph >= hStd + 3)
+        free(ph);
+    return TRUE;
+}
+
+BOOL DeleteFileW(LPCWSTR pszName)
+{
+    return unlink(path_utf8(pszName)) == 0;
+}
+
+DWORD GetTempPathW(DWORD cch, LPWSTR psz)
+{
+    const char* pszDir = getenv("TMPDIR");
+    char buf[MAX_PATH];
+    snprintf(buf, sizeof(buf), "%s/", (pszDir != NULL && *pszDir != 0) ? pszDir : "/tmp");
+    return (DWORD)MultiByteToWideChar(CP_UTF8, 0, buf, -1, psz, (int)cch) - 1;
+}
+
+UINT GetTempFileNameW(LPCWSTR pszDir, LPCWSTR pszPrefix, UINT unique, LPWSTR pszName)
+{
+    char buf[MAX_PATH];
+    (void)unique;
+    int n = snprintf(buf, sizeof(buf), "%s", path_utf8(pszDir));
+    snprintf(buf + n, sizeof(buf) - (size_t)n, "%sXXXXXX", path_utf8(pszPrefix));
+    int fd = mkstemp(buf);
+    if (fd < 0)
+        return 0;
+    close(fd);
+    MultiByteToWideChar(CP_UTF8, 0, buf, -1, pszName, MAX_PATH);
+    return 1;
+}
+
+HANDLE CreateFileMappingW(HANDLE h, void* pSec, DWORD prot, DWORD sizeHigh, DWORD sizeLow,
+    LPCWSTR pszName)
+{
+    uint64_t size = ((uint64_t)sizeHigh << 32) | sizeLow;
+    struct stat st;
+    int fd;
+    (void)pSec;
+    (void)prot;
+
+    if (h != INVALID_HANDLE_VALUE) {
+        // file-backed
+        fd = dup(((SHIM_HANDLE*)h)->fd);
+    } else {
+        // named: the first one sets the size
+        const char* pszPath = shim_path(pszName);
+        fd = open(pszPath, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0 && ftruncate(fd, (off_t)size) != 0) {
+            close(fd);
+            fd = -1;
+        } else if (fd < 0) {
+            fd = open(pszPath, O_RDWR);
+        }
+    }
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+
+    SHIM_HANDLE* ph = handle_new(SH_MAPPING, fd);
+    ph->size = (uint64_t)st.st_size;
+    return ph;
+}
+
+HANDLE OpenFileMappingW(DWORD access, BOOL inherit, LPCWSTR pszName)
+{
+    struct stat st;
+    (void)access;
+    (void)inherit;
+    int fd = open(shim_path(pszName), O_RDWR);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0)
+            close(fd);
+        dwLastError = ERROR_FILE_NOT_FOUND;
+        return NULL;
+    }
+
+    SHIM_HANDLE* ph = handle_new(SH_MAPPING, fd);
+    ph->size = (uint64_t)st.st_size;
+    return ph;
+}
+
+LPVOID MapViewOfFile(HANDLE h, DWORD access, DWORD offHigh, DWORD offLow, SIZE_T sz)
+{
+    SHIM_HANDLE* ph = h;
+    (void)offHigh;
+    (void)offLow;
+    if (sz == 0)
+        sz = (SIZE_T)ph->size;
+    for (size_t i = 0; i < VIEW_MAX; ++i) {
+        if (views[i].ptr == NULL) {
+            void* ptr = mmap(NULL, sz, (access & FILE_MAP_WRITE) ? PROT_READ | PROT_WRITE
+                : PROT_READ, MAP_SHARED, ph->fd, 0);
+            if (ptr == MAP_FAILED)
+                return NULL;
+            views[i].ptr = ptr;
+            views[i].sz = sz;
+            return ptr;
+        }
+    }
+    return NULL;
+}
+
+BOOL UnmapViewOfFile(LPCVOID ptr)
+{
+    for (size_t i = 0; i < VIEW_MAX; ++i) {
+        if (views[i].ptr == ptr) {
+            munmap(views[i].ptr, views[i].sz);
+            views[i].ptr = NULL;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+DWORD GetLastError(void)
+{
+    return dwLastError;
+}
+
+
+//
+// memory
+//
+
+HGLOBAL GlobalAlloc(UINT flags, SIZE_T sz)
+{
+    SHIM_GLOBAL* pg = malloc(sizeof(SHIM_GLOBAL));
+    (void)flags;
+    pg->sz = sz;
+    pg->pb = malloc(sz + 1);
+    return pg;
+}
+
+HGLOBAL GlobalReAlloc(HGLOBAL h, SIZE_T sz, UINT flags)
+{
+    SHIM_GLOBAL* pg = h;
+    (void)flags;
+    pg->pb = realloc(pg->pb, sz + 1);
+    pg->sz = sz;
+    return pg;
+}
+
+LPVOID GlobalLock(HGLOBAL h)
+{
+    return (h != NULL) ? ((SHIM_GLOBAL*)h)->pb : NULL;
+}
+
+BOOL GlobalUnlock(HGLOBAL h)
+{
+    (void)h;
+    return TRUE;
+}
+
+SIZE_T GlobalSize(HGLOBAL h)
+{
+    return (h != NULL) ? ((SHIM_GLOBAL*)h)->sz : 0;
+}
+
+HGLOBAL GlobalFree(HGLOBAL h)
+{
+    if (h != NULL) {
+        free(((SHIM_GLOBAL*)h)->pb);
+        free(h);
+    }
+    return NULL;
+}
+
+HANDLE GetProcessHeap(void)
+{
+    return &hStd[0];
+}
+
+// blocks start with their size
+LPVOID HeapAlloc(HANDLE hHeap, DWORD flags, SIZE_T sz)
+{
+    (void)hHeap;
+    size_t* p = malloc(sizeof(size_t) * 2 + sz);
+    if (p == NULL && (flags & HEAP_GENERATE_EXCEPTIONS))
+        abort();
+    if (p == NULL)
+        return NULL;
+    *p = sz;
+    return p + 2;
+}
+
+LPVOID HeapReAlloc(HANDLE hHeap, DWORD flags, LPVOID ptr, SIZE_T sz)
+{
+    (void)hHeap;
+    size_t* p = realloc((size_t*)ptr - 2, sizeof(size_t) * 2 + sz);
+    if (p == NULL && (flags & HEAP_GENERATE_EXCEPTIONS))
+        abort();
+    if (p == NULL)
+        return NULL;
+    *p = sz;
+    return p + 2;
+}
+
+BOOL HeapFree(HANDLE hHeap, DWORD flags, LPVOID ptr)
+{
+    (void)hHeap;
+    (void)flags;
+    if (ptr != NULL)
+        free((size_t*)ptr - 2);
+    return TRUE;
+}
+
+SIZE_T HeapSize(HANDLE hHeap, DWORD flags, LPCVOID ptr)
+{
+    (void)hHeap;
+    (void)flags;
+    return *((const size_t*)ptr - 2);
+}
+
+
+//
+// clipboard: [seq u32] [count u32] then {format u32, size u64, data} for each format
+//
+
+BOOL OpenClipboard(HWND hwnd)
+{
+    char szLock[MAX_PATH + 8];
+    (void)hwnd;
+    if (clip.fdLock >= 0)
+        return FALSE;
+    snprintf(szLock, sizeof(szLock), "%s.lock", clip_path());
+    clip.fdLock = open(szLock, O_RDWR | O_CREAT, 0600);
+    if (clip.fdLock < 0 || flock(clip.fdLock, LOCK_EX) != 0) {
+        if (clip.fdLock >= 0)
+            close(clip.fdLock);
+        clip.fdLock = -1;
+        return FALSE;
+    }
+    clip.dirty = false;
+    clip_read(clip_path(), &clip.seq, 0);
+    return TRUE;
+}
+
+BOOL CloseClipboard(void)
+{
+    if (clip.fdLock < 0)
+        return FALSE;
+
+    if (clip.dirty) {
+        // readers of the sequence number never see a partial file
+        char szTmp[MAX_PATH + 8];
+        snprintf(szTmp, sizeof(szTmp), "%s.new", clip_path());
+        FILE* f = fopen(szTmp, "wb");
+        if (f != NULL) {
+            uint32_t hdr[2] = { clip.seq + 1, clip.n };
+            fwrite(hdr, sizeof(hdr), 1, f);
+            for (UINT i = 0; i < clip.n; ++i) {
+                uint32_t fmt = clip.fmt[i];
+                uint64_t sz = clip.h[i]->sz;
+                fwrite(&fmt, sizeof(fmt), 1, f);
+                fwrite(&sz, sizeof(sz), 1, f);
+                fwrite(clip.h[i]->pb, 1, sz, f);
+            }
+            fclose(f);
+            rename(szTmp, clip_path());
+        }
+    }
+
+    clip_drop();
+    flock(clip.fdLock, LOCK_UN);
+    close(clip.fdLock);
+    clip.fdLock = -1;
+    return TRUE;
+}
+
+BOOL EmptyClipboard(void)
+{
+    clip_drop();
+    clip.dirty = true;
+    return TRUE;
+}
+
+HANDLE GetClipboardData(UINT fmt)
+{
+    for (UINT i = 0; i < clip.n; ++i) {
+        if (clip.fmt[i] == fmt)
+            return clip.h[i];
+    }
+    return NULL;
+}
+
+HANDLE SetClipboardData(UINT fmt, HANDLE h)
+{
+    if (clip.n >= CLIP_MAX)
+        return NULL;
+    clip.fmt[clip.n] = fmt;
+    clip.h[clip.n++] = h;
+    clip.dirty = true;
+    return h;
+}
+
+BOOL IsClipboardFormatAvailable(UINT fmt)
+{
+    uint32_t seq;
+    return clip_read(clip_path(), &seq, fmt);
+}
+
+UINT EnumClipboardFormats(UINT fmt)
+{
+    UINT i = 0;
+    if (fmt != 0) {
+        while (i < clip.n && clip.fmt[i] != fmt)
+            ++i;
+        ++i;
+    }
+    return (i < clip.n) ? clip.fmt[i] : 0;
+}
+
+UINT RegisterClipboardFormatW(LPCWSTR pszName)
+{
+    const char* psz = path_utf8(pszName);
+    for (UINT i = 0; i < nNames; ++i) {
+        if (strcmp(names[i], psz) == 0)
+            return 0xC000 + i;
+    }
+    if (nNames >= CLIP_MAX)
+        return 0;
+    snprintf(names[nNames], sizeof(names[0]), "%s", psz);
+    return 0xC000 + nNames++;
+}
+
+int GetClipboardFormatNameW(UINT fmt, LPWSTR psz, int cch)
+{
+    if (fmt < 0xC000 || fmt - 0xC000 >= nNames)
+        return 0;
+    return MultiByteToWideChar(CP_UTF8, 0, names[fmt - 0xC000], -1, psz, cch) - 1;
+}
+
+DWORD GetClipboardSequenceNumber(void)
+{
+    uint32_t seq = 0;
+    FILE* f = fopen(clip_path(), "rb");
+    if (f != NULL) {
+        if (fread(&seq, sizeof(seq), 1, f) != 1)
+            seq = 0;
+        fclose(f);
+    }
+    return seq;
+}
+
+BOOL AddClipboardFormatListener(HWND hwnd)
+{
+    (void)hwnd;
+    pthread_mutex_lock(&queue.lock);
+    queue.dwSeq = GetClipboardSequenceNumber();
+    queue.listening = true;
+    pthread_mutex_unlock(&queue.lock);
+    return TRUE;
+}
+
+BOOL RemoveClipboardFormatListener(HWND hwnd)
+{
+    (void)hwnd;
+    queue.listening = false;
+    return TRUE;
+}
+
+
+//
+// windows and messages: a single queue for the process
+//
+
+HWND CreateWindowExW(DWORD exStyle, LPCWSTR pszClass, LPCWSTR pszName, DWORD style, int x,
+    int y, int cx, int cy, HWND hParent, void* hMenu, void* hInst, LPVOID pParam)
+{
+    static int window;
+    (void)exStyle;
+    (void)pszClass;
+    (void)pszName;
+    (void)style;
+    (void)x;
+    (void)y;
+    (void)cx;
+    (void)cy;
+    (void)hParent;
+    (void)hMenu;
+    (void)hInst;
+    (void)pParam;
+    return &window;
+}
+
+BOOL DestroyWindow(HWND hwnd)
+{
+    (void)hwnd;
+    return TRUE;
+}
+
+BOOL GetMessageW(MSG* pMsg, HWND hwnd, UINT first, UINT last)
+{
+    (void)hwnd;
+    (void)first;
+    (void)last;
+    while (!msg_poll(pMsg, true))
+        sleep_ms(2);
+    return TRUE;
+}
+
+BOOL PeekMessageW(MSG* pMsg, HWND hwnd, UINT first, UINT last, UINT remove)
+{
+    (void)hwnd;
+    (void)first;
+    (void)last;
+    return msg_poll(pMsg, remove == PM_REMOVE);
+}
+
+LRESULT DispatchMessageW(const MSG* pMsg)
+{
+    (void)pMsg;
+    return 0;
+}
+
+BOOL PostThreadMessageW(DWORD tid, UINT msg, WPARAM wParam, LPARAM lParam)
+{
+    (void)tid;
+    pthread_mutex_lock(&queue.lock);
+    bool ok = (queue.tail + 1) % QUEUE_MAX != queue.head;
+    if (ok) {
+        MSG* pMsg = &queue.msg[queue.tail];
+        memset(pMsg, 0, sizeof(*pMsg));
+        pMsg->message = msg;
+        pMsg->wParam = wParam;
+        pMsg->lParam = lParam;
+        queue.tail = (queue.tail + 1) % QUEUE_MAX;
+    }
+    pthread_mutex_unlock(&queue.lock);
+    return ok;
+}
+
+DWORD MsgWaitForMultipleObjects(DWORD n, const HANDLE* ph, BOOL all, DWORD ms, DWORD mask)
+{
+    DWORD dwStart = GetTickCount();
+    MSG msg;
+    (void)ph;
+    (void)all;
+    (void)mask;
+    while (!msg_poll(&msg, false)) {
+        if (ms != INFINITE && GetTickCount() - dwStart >= ms)
+            return WAIT_TIMEOUT;
+        sleep_ms(2);
+    }
+    return WAIT_OBJECT_0 + n;
+}
+
+
+//
+// threads and synchronization
+//
+
+typedef struct {
+    LPTHREAD_START_ROUTINE proc;
+    LPVOID param;
+} THREAD_START;
+
+static void* thread_start(void* p)
+{
+    THREAD_START ts = *(THREAD_START*)p;
+    free(p);
+    ts.proc(ts.param);
+    return NULL;
+}
+
+HANDLE CreateThread(void* pSec, SIZE_T stack, LPTHREAD_START_ROUTINE proc, LPVOID param,
+    DWORD flags, LPDWORD ptid)
+{
+    pthread_t t;
+    THREAD_START* pts = malloc(sizeof(THREAD_START));
+    (void)pSec;
+    (void)stack;
+    (void)flags;
+    (void)ptid;
+    pts->proc = proc;
+    pts->param = param;
+    if (pthread_create(&t, NULL, thread_start, pts) != 0) {
+        free(pts);
+        return NULL;
+    }
+    pthread_detach(t);
+    return handle_new(SH_THREAD, -1);
+}
+
+DWORD GetCurrentThreadId(void)
+{
+    return 1;
+}
+
+HANDLE CreateEventW(void* pSec, BOOL manual, BOOL initial, LPCWSTR pszName)
+{
+    (void)pSec;
+    (void)manual;
+    (void)initial;
+    (void)pszName;
+    return handle_new(SH_EVENT, -1);
+}
+
+HANDLE OpenEventW(DWORD access, BOOL inherit, LPCWSTR pszName)
+{
+    (void)access;
+    (void)inherit;
+    (void)pszName;
+    return handle_new(SH_EVENT, -1);
+}
+
+BOOL SetEvent(HANDLE h)
+{
+    (void)h;
+    return TRUE;
+}
+
+BOOL ResetEvent(HANDLE h)
+{
+    (void)h;
+    return TRUE;
+}
+
+// named mutex = flock() on a file
+HANDLE CreateMutexW(void* pSec, BOOL owner, LPCWSTR pszName)
+{
+    (void)pSec;
+    int fd = open(shim_path(pszName), O_RDWR | O_CREAT, 0600);
+    if (fd < 0)
+        return NULL;
+    if (owner)
+        flock(fd, LOCK_EX);
+    return handle_new(SH_MUTEX, fd);
+}
+
+BOOL ReleaseMutex(HANDLE h)
+{
+    return flock(((SHIM_HANDLE*)h)->fd, LOCK_UN) == 0;
+}
+
+DWORD WaitForSingleObject(HANDLE h, DWORD ms)
+{
+    SHIM_HANDLE* ph = h;
+    DWORD dwStart = GetTickCount();
+
+    if (ph->type != SH_MUTEX) {
+        // events never fire
+        sleep_ms((ms < 10) ? ms : 10);
+        return WAIT_TIMEOUT;
+    }
+    while (flock(ph->fd, LOCK_EX | LOCK_NB) != 0) {
+        if (ms != INFINITE && GetTickCount() - dwStart >= ms)
+            return WAIT_TIMEOUT;
+        sleep_ms(2);
+    }
+    return WAIT_OBJECT_0;
+}
+
+void Sleep(DWORD ms)
+{
+    sleep_ms(ms);
+}
+
+
+//
+// time and environment
+//
+
+DWORD GetTickCount(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (DWORD)((uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000);
+}
+
+BOOL QueryPerformanceCounter(LARGE_INTEGER* p)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    p->QuadPart = (LONGLONG)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    return TRUE;
+}
+
+BOOL QueryPerformanceFrequency(LARGE_INTEGER* p)
+{
+    p->QuadPart = 1000000000;
+    return TRUE;
+}
+
+void GetSystemTimeAsFileTime(FILETIME* pft)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t t = ((uint64_t)ts.tv_sec + 11644473600u) * 10000000 + (uint64_t)ts.tv_nsec / 100;
+    pft->dwLowDateTime = (DWORD)(t & 0xFFFFFFFF);
+    pft->dwHighDateTime = (DWORD)(t >> 32);
+}
+
+DWORD GetEnvironmentVariableW(LPCWSTR pszName, LPWSTR psz, DWORD cch)
+{
+    const char* pszValue = getenv(path_utf8(pszName));
+    if (pszValue == NULL)
+        return 0;
+    DWORD cchNeed = (DWORD)MultiByteToWideChar(CP_UTF8, 0, pszValue, -1, NULL, 0);
+    if (cchNeed > cch)
+        return cchNeed;
+    return (DWORD)MultiByteToWideChar(CP_UTF8, 0, pszValue, -1, psz, (int)cch) - 1;
+}
+
+BOOL GetUserNameW(LPWSTR psz, LPDWORD pcch)
+{
+    const char* pszUser = getenv("USER");
+    if (pszUser == NULL || *pszUser == 0)
+        pszUser = "user";
+    int n = MultiByteToWideChar(CP_UTF8, 0, pszUser, -1, psz, (int)*pcch);
+    if (n == 0)
+        return FALSE;
+    *pcch = (DWORD)n;
+    return TRUE;
+}
+
+
+//
+// helpers
+//
+
+// UTF-16 => UTF-8 (static buffer)
+const char* path_utf8(LPCWSTR psz)
+{
+    static char buf[4 * MAX_PATH];
+    if (WideCharToMultiByte(CP_UTF8, 0, psz, -1, buf, sizeof(buf), NULL, NULL) == 0)
+        buf[0] = 0;
+    return buf;
+}
+
+// clipboard file
+const char* clip_path(void)
+{
+    static char buf[MAX_PATH];
+    if (buf[0] == 0) {
+        const char* psz = getenv("WIN32YANG_CLIPBOARD");
+        const char* pszDir = getenv("TMPDIR");
+        if (psz != NULL && *psz != 0)
+            snprintf(buf, sizeof(buf), "%s", psz);
+        else
+            snprintf(buf, sizeof(buf), "%s/win32yang-clipboard",
+                (pszDir != NULL && *pszDir != 0) ? pszDir : "/tmp");
+    }
+    return buf;
+}
+
+// named object => file in $WIN32YANG_SHIM_DIR (static buffer)
+const char* shim_path(LPCWSTR pszName)
+{
+    static char buf[2 * MAX_PATH];
+    const char* pszDir = getenv("WIN32YANG_SHIM_DIR");
+    if (pszDir == NULL || *pszDir == 0)
+        pszDir = getenv("TMPDIR");
+    if (pszDir == NULL || *pszDir == 0)
+        pszDir = "/tmp";
+    int n = snprintf(buf, sizeof(buf), "%s/shim-", pszDir);
+    snprintf(buf + n, sizeof(buf) - (size_t)n, "%s", path_utf8(pszName));
+    for (char* p = buf + n; *p != 0; ++p) {
+        if (*p == '\\' || *p == '/')
+            *p = '_';
+    }
+    return buf;
+}
+
+// clipboard file => clip (fmtWant = 0) or test for fmtWant
+// returns false if the file is missing (or has no fmtWant)
+bool clip_read(const char* pszPath, uint32_t* pseq, UINT fmtWant)
+{
+    bool found = false;
+    uint32_t hdr[2];
+    FILE* f = fopen(pszPath, "rb");
+
+    *pseq = 0;
+    if (fmtWant == 0)
+        clip_drop();
+    if (f == NULL)
+        return false;
+    if (fread(hdr, sizeof(hdr), 1, f) == 1) {
+        *pseq = hdr[0];
+        for (uint32_t i = 0; i < hdr[1] && i < CLIP_MAX && !found; ++i) {
+            uint32_t fmt;
+            uint64_t sz;
+            if (fread(&fmt, sizeof(fmt), 1, f) != 1 || fread(&sz, sizeof(sz), 1, f) != 1)
+                break;
+            if (fmtWant != 0) {
+                found = fmt == fmtWant;
+                fseek(f, (long)sz, SEEK_CUR);
+                continue;
+            }
+            SHIM_GLOBAL* pg = GlobalAlloc(GMEM_MOVEABLE, (SIZE_T)sz);
+            if (fread(pg->pb, 1, (size_t)sz, f) != sz) {
+                GlobalFree(pg);
+                break;
+            }
+            clip.fmt[clip.n] = fmt;
+            clip.h[clip.n++] = pg;
+        }
+    }
+    fclose(f);
+    return (fmtWant == 0) || found;
+}
+
+// free formats held
+void clip_drop(void)
+{
+    for (UINT i = 0; i < clip.n; ++i)
+        GlobalFree(clip.h[i]);
+    clip.n = 0;
+}
+
+HANDLE handle_new(int type, int fd)
+{
+    SHIM_HANDLE* ph = malloc(sizeof(SHIM_HANDLE));
+    ph->type = type;
+    ph->fd = fd;
+    ph->size = 0;
+    return ph;
+}
+
+void sleep_ms(DWORD ms)
+{
+    struct timespec ts = { (time_t)(ms / 1000), (long)(ms % 1000) * 1000000 };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        ;
+}
+
+// clipboard update or posted message => *pMsg
+bool msg_poll(MSG* pMsg, bool remove)
+{
+    bool got = false;
+    pthread_mutex_lock(&queue.lock);
+    if (queue.listening) {
+        DWORD dwSeq = GetClipboardSequenceNumber();
+        if (dwSeq != queue.dwSeq) {
+            if (remove)
+                queue.dwSeq = dwSeq;
+            memset(pMsg, 0, sizeof(*pMsg));
+            pMsg->message = WM_CLIPBOARDUPDATE;
+            got = true;
+        }
+    }
+    if (!got && queue.head != queue.tail) {
+        *pMsg = queue.msg[queue.head];
+        if (remove)
+            queue.head = (queue.head + 1) % QUEUE_MAX;
+        got = true;
+    }
+    pthread_mutex_unlock(&queue.lock);
+    return got;
+}
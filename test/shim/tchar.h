@@ -0,0 +1,18 @@
+/*
+ * tchar.h - UNICODE generic-text names for the POSIX shim (tests only)
+ * License:  https://unlicense.org
+ */
+
+
+#if !defined(SHIM_TCHAR_H)
+#define SHIM_TCHAR_H
+
+#include <stddef.h>
+
+typedef wchar_t _TCHAR;
+#define _T(x) L##x
+#define _tmain wmain
+
+int wmain(int argc, wchar_t* argv[]);
+
+#endif // SHIM_TCHAR_H
@@ -0,0 +1,252 @@
+/*
+ * windows.h - the part of Win32 used by win32yang, on POSIX (tests only)
+ * License:    https://unlicense.org
+ *
+ * Build with -fshort-wchar -DUNICODE so that wchar_t literals are UTF-16.
+ * See shim.c for what is emulated and how.
+ */
+
+
+#if !defined(SHIM_WINDOWS_H)
+#define SHIM_WINDOWS_H
+
+#if !defined(UNICODE)
+#error The shim supports -DUNICODE builds only.
+#endif // UNICODE
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// types
+#define WINAPI
+typedef int BOOL;
+typedef uint8_t BYTE;
+typedef uint16_t WORD;
+typedef unsigned long DWORD;
+typedef long LONG;
+typedef int64_t LONGLONG;
+typedef unsigned int UINT;
+typedef uintptr_t SIZE_T;
+typedef uintptr_t WPARAM;
+typedef intptr_t LPARAM;
+typedef intptr_t LRESULT;
+typedef wchar_t WCHAR;
+typedef const char* LPCSTR;
+typedef char* LPSTR;
+typedef const WCHAR* LPCWSTR;
+typedef WCHAR* LPWSTR;
+typedef void* LPVOID;
+typedef const void* LPCVOID;
+typedef DWORD* LPDWORD;
+typedef void* HANDLE;
+typedef void* HGLOBAL;
+typedef void* HWND;
+typedef union {
+    struct {
+        DWORD LowPart;
+        LONG HighPart;
+    } u;
+    LONGLONG QuadPart;
+} LARGE_INTEGER;
+typedef struct {
+    DWORD dwLowDateTime;
+    DWORD dwHighDateTime;
+} FILETIME;
+typedef struct {
+    UINT MaxCharSize;
+    BYTE DefaultChar[2];
+    BYTE LeadByte[12];
+} CPINFO;
+typedef struct {
+    HWND hwnd;
+    UINT message;
+    WPARAM wParam;
+    LPARAM lParam;
+    DWORD time;
+    LONG pt[2];
+} MSG;
+typedef enum {
+    NormalizationOther = 0,
+    NormalizationC = 1,
+    NormalizationD = 2,
+    NormalizationKC = 5,
+    NormalizationKD = 6
+} NORM_FORM;
+typedef DWORD (WINAPI* LPTHREAD_START_ROUTINE)(LPVOID);
+
+
+// constants
+#define TRUE 1
+#define FALSE 0
+#define MAX_PATH 260
+#define INFINITE 0xFFFFFFFF
+#define INVALID_HANDLE_VALUE ((HANDLE)(intptr_t)-1)
+#define CP_ACP 0
+#define CP_OEMCP 1
+#define CP_UTF8 65001
+#define CF_BITMAP 2
+#define CF_METAFILEPICT 3
+#define CF_PALETTE 9
+#define CF_UNICODETEXT 13
+#define CF_ENHMETAFILE 14
+#define CF_OWNERDISPLAY 0x0080
+#define CF_DSPBITMAP 0x0082
+#define CF_DSPMETAFILEPICT 0x0083
+#define CF_DSPENHMETAFILE 0x008E
+#define CF_PRIVATEFIRST 0x0200
+#define CF_GDIOBJLAST 0x03FF
+#define GMEM_MOVEABLE 0x0002
+#define HEAP_GENERATE_EXCEPTIONS 0x0004
+#define STD_INPUT_HANDLE ((DWORD)-10)
+#define STD_OUTPUT_HANDLE ((DWORD)-11)
+#define STD_ERROR_HANDLE ((DWORD)-12)
+#define GENERIC_READ 0x80000000
+#define GENERIC_WRITE 0x40000000
+#define FILE_APPEND_DATA 0x0004
+#define FILE_SHARE_READ 0x0001
+#define FILE_SHARE_WRITE 0x0002
+#define CREATE_ALWAYS 2
+#define OPEN_EXISTING 3
+#define OPEN_ALWAYS 4
+#define FILE_ATTRIBUTE_NORMAL 0x0080
+#define FILE_TYPE_UNKNOWN 0
+#define FILE_TYPE_DISK 1
+#define FILE_TYPE_CHAR 2
+#define FILE_TYPE_PIPE 3
+#define PAGE_READONLY 0x02
+#define PAGE_READWRITE 0x04
+#define FILE_MAP_WRITE 0x0002
+#define FILE_MAP_READ 0x0004
+#define SYNCHRONIZE 0x00100000
+#define WAIT_OBJECT_0 0
+#define WAIT_ABANDONED 0x80
+#define WAIT_TIMEOUT 258
+#define HWND_MESSAGE ((HWND)(intptr_t)-3)
+#define WM_CLIPBOARDUPDATE 0x031D
+#define WM_APP 0x8000
+#define PM_NOREMOVE 0
+#define PM_REMOVE 1
+#define QS_ALLINPUT 0x04FF
+#define ERROR_FILE_NOT_FOUND 2
+#define ERROR_NOT_SUPPORTED 50
+#define ERROR_BROKEN_PIPE 109
+#define ERROR_INSUFFICIENT_BUFFER 122
+#define ERROR_NO_UNICODE_TRANSLATION 1113
+#define MemoryBarrier() __sync_synchronize()
+#define _alloca __builtin_alloca
+
+
+// UNICODE names
+#define lstrcmp lstrcmpW
+#define lstrlen lstrlenW
+#define CreateFile CreateFileW
+#define DeleteFile DeleteFileW
+#define GetTempPath GetTempPathW
+#define GetTempFileName GetTempFileNameW
+#define CreateFileMapping CreateFileMappingW
+#define OpenFileMapping OpenFileMappingW
+#define CreateEvent CreateEventW
+#define OpenEvent OpenEventW
+#define CreateMutex CreateMutexW
+#define CreateWindowEx CreateWindowExW
+#define GetMessage GetMessageW
+#define PeekMessage PeekMessageW
+#define DispatchMessage DispatchMessageW
+#define PostThreadMessage PostThreadMessageW
+#define GetEnvironmentVariable GetEnvironmentVariableW
+#define GetUserName GetUserNameW
+
+
+// strings and code pages
+int lstrcmpW(LPCWSTR psz1, LPCWSTR psz2);
+int lstrlenW(LPCWSTR psz);
+UINT GetACP(void);
+UINT GetOEMCP(void);
+BOOL GetCPInfo(UINT cp, CPINFO* pInfo);
+BOOL IsDBCSLeadByteEx(UINT cp, BYTE b);
+int MultiByteToWideChar(UINT cp, DWORD flags, LPCSTR pIn, int cbIn, LPWSTR pOut,
+    int cchOut);
+int WideCharToMultiByte(UINT cp, DWORD flags, LPCWSTR pIn, int cchIn, LPSTR pOut,
+    int cbOut, LPCSTR pDefault, BOOL* pUsed);
+int NormalizeString(NORM_FORM form, LPCWSTR pIn, int cchIn, LPWSTR pOut, int cchOut);
+BOOL IsNormalizedString(NORM_FORM form, LPCWSTR pIn, int cchIn);
+
+// files
+HANDLE GetStdHandle(DWORD n);
+DWORD GetFileType(HANDLE h);
+HANDLE CreateFileW(LPCWSTR pszName, DWORD access, DWORD share, void* pSec, DWORD disp,
+    DWORD attr, HANDLE hTemplate);
+BOOL ReadFile(HANDLE h, LPVOID ptr, DWORD cb, LPDWORD pcbRead, void* pOverlapped);
+BOOL WriteFile(HANDLE h, LPCVOID ptr, DWORD cb, LPDWORD pcbWritten, void* pOverlapped);
+BOOL GetFileSizeEx(HANDLE h, LARGE_INTEGER* pSize);
+BOOL CloseHandle(HANDLE h);
+BOOL DeleteFileW(LPCWSTR pszName);
+DWORD GetTempPathW(DWORD cch, LPWSTR psz);
+UINT GetTempFileNameW(LPCWSTR pszDir, LPCWSTR pszPrefix, UINT unique, LPWSTR pszName);
+HANDLE CreateFileMappingW(HANDLE h, void* pSec, DWORD prot, DWORD sizeHigh, DWORD sizeLow,
+    LPCWSTR pszName);
+HANDLE OpenFileMappingW(DWORD access, BOOL inherit, LPCWSTR pszName);
+LPVOID MapViewOfFile(HANDLE h, DWORD access, DWORD offHigh, DWORD offLow, SIZE_T sz);
+BOOL UnmapViewOfFile(LPCVOID ptr);
+DWORD GetLastError(void);
+
+// memory
+HGLOBAL GlobalAlloc(UINT flags, SIZE_T sz);
+HGLOBAL GlobalReAlloc(HGLOBAL h, SIZE_T sz, UINT flags);
+LPVOID GlobalLock(HGLOBAL h);
+BOOL GlobalUnlock(HGLOBAL h);
+SIZE_T GlobalSize(HGLOBAL h);
+HGLOBAL GlobalFree(HGLOBAL h);
+HANDLE GetProcessHeap(void);
+LPVOID HeapAlloc(HANDLE hHeap, DWORD flags, SIZE_T sz);
+LPVOID HeapReAlloc(HANDLE hHeap, DWORD flags, LPVOID ptr, SIZE_T sz);
+BOOL HeapFree(HANDLE hHeap, DWORD flags, LPVOID ptr);
+SIZE_T HeapSize(HANDLE hHeap, DWORD flags, LPCVOID ptr);
+
+// clipboard
+BOOL OpenClipboard(HWND hwnd);
+BOOL CloseClipboard(void);
+BOOL EmptyClipboard(void);
+HANDLE GetClipboardData(UINT fmt);
+HANDLE SetClipboardData(UINT fmt, HANDLE h);
+BOOL IsClipboardFormatAvailable(UINT fmt);
+UINT EnumClipboardFormats(UINT fmt);
+UINT RegisterClipboardFormatW(LPCWSTR pszName);
+int GetClipboardFormatNameW(UINT fmt, LPWSTR psz, int cch);
+DWORD GetClipboardSequenceNumber(void);
+BOOL AddClipboardFormatListener(HWND hwnd);
+BOOL RemoveClipboardFormatListener(HWND hwnd);
+
+// windows and messages
+HWND CreateWindowExW(DWORD exStyle, LPCWSTR pszClass, LPCWSTR pszName, DWORD style, int x,
+    int y, int cx, int cy, HWND hParent, void* hMenu, void* hInst, LPVOID pParam);
+BOOL DestroyWindow(HWND hwnd);
+BOOL GetMessageW(MSG* pMsg, HWND hwnd, UINT first, UINT last);
+BOOL PeekMessageW(MSG* pMsg, HWND hwnd, UINT first, UINT last, UINT remove);
+LRESULT DispatchMessageW(const MSG* pMsg);
+BOOL PostThreadMessageW(DWORD tid, UINT msg, WPARAM wParam, LPARAM lParam);
+DWORD MsgWaitForMultipleObjects(DWORD n, const HANDLE* ph, BOOL all, DWORD ms, DWORD mask);
+
+// threads and synchronization
+HANDLE CreateThread(void* pSec, SIZE_T stack, LPTHREAD_START_ROUTINE proc, LPVOID param,
+    DWORD flags, LPDWORD ptid);
+DWORD GetCurrentThreadId(void);
+HANDLE CreateEventW(void* pSec, BOOL manual, BOOL initial, LPCWSTR pszName);
+HANDLE OpenEventW(DWORD access, BOOL inherit, LPCWSTR pszName);
+BOOL SetEvent(HANDLE h);
+BOOL ResetEvent(HANDLE h);
+HANDLE CreateMutexW(void* pSec, BOOL owner, LPCWSTR pszName);
+BOOL ReleaseMutex(HANDLE h);
+DWORD WaitForSingleObject(HANDLE h, DWORD ms);
+void Sleep(DWORD ms);
+
+// time and environment
+DWORD GetTickCount(void);
+BOOL QueryPerformanceCounter(LARGE_INTEGER* p);
+BOOL QueryPerformanceFrequency(LARGE_INTEGER* p);
+void GetSystemTimeAsFileTime(FILETIME* pft);
+DWORD GetEnvironmentVariableW(LPCWSTR pszName, LPWSTR psz, DWORD cch);
+BOOL GetUserNameW(LPWSTR psz, LPDWORD pcch);
+
+#endif // SHIM_WINDOWS_H
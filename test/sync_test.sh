@@ -0,0 +1,72 @@
+#!/bin/sh
+# sync_test - two --sync processes over pipes, each with its own clipboard (POSIX)
+# License:    https://unlicense.org
+#
+# Runs ./wy, which is win32yang.c built with the shim (make -C test wy). Checks that plain
+# changes go both ways, that both sides settle on the same text when they change at once,
+# and that a large text arrives whole.
+#
+# usage: sync_test.sh
+
+WY=${WY:-./wy}
+DIR=$(mktemp -d) || exit 2
+A=$DIR/a.clip
+B=$DIR/b.clip
+export WIN32YANG_SHIM_DIR=$DIR
+trap 'kill -CONT $PA $PB 2>/dev/null; kill $PA $PB 2>/dev/null; rm -rf "$DIR"' EXIT
+fail() { echo "FAIL: $*"; exit 1; }
+
+# clipboard X (a or b) <=> stdin/stdout
+set_clip() { WIN32YANG_CLIPBOARD=$1 "$WY" -i; }
+get_clip() { WIN32YANG_CLIPBOARD=$1 "$WY" -o; }
+
+# waits up to 10 s until both clipboards hold the same text, then prints it
+wait_same() {
+    i=0
+    while [ $i -lt 100 ]; do
+        get_clip "$A" > "$DIR/a.txt"
+        get_clip "$B" > "$DIR/b.txt"
+        if cmp -s "$DIR/a.txt" "$DIR/b.txt"; then
+            cat "$DIR/a.txt"
+            return 0
+        fi
+        sleep 0.1
+        i=$((i + 1))
+    done
+    return 1
+}
+
+# A opens its output first, B its input, or both block opening the FIFOs
+mkfifo "$DIR/ab" "$DIR/ba" || exit 2
+WIN32YANG_CLIPBOARD=$A "$WY" --sync > "$DIR/ab" < "$DIR/ba" 2> "$DIR/a.err" &
+PA=$!
+WIN32YANG_CLIPBOARD=$B "$WY" --sync < "$DIR/ab" > "$DIR/ba" 2> "$DIR/b.err" &
+PB=$!
+sleep 0.5
+
+# plain changes
+printf 'from a' | set_clip "$A"
+[ "$(wait_same)" = "from a" ] || fail "a => b"
+printf 'from b' | set_clip "$B"
+[ "$(wait_same)" = "from b" ] || fail "b => a"
+
+# both sides change before either hears from the other
+kill -STOP $PA $PB
+printf 'alpha' | set_clip "$A"
+printf 'bravo' | set_clip "$B"
+kill -CONT $PA $PB
+TEXT=$(wait_same) || fail "conflict: a=$(get_clip "$A") b=$(get_clip "$B")"
+[ "$TEXT" = alpha ] || [ "$TEXT" = bravo ] || fail "conflict: $TEXT"
+sleep 1
+[ "$(get_clip "$A")" = "$TEXT" ] && [ "$(get_clip "$B")" = "$TEXT" ] \
+    || fail "conflict: settled on $TEXT, then a=$(get_clip "$A") b=$(get_clip "$B")"
+
+# large text, not ASCII
+awk 'BEGIN { for (i = 0; i < 20000; ++i) printf "%06d \303\251\342\202\254\360\237\230\200\n", i }' \
+    > "$DIR/big.txt"
+set_clip "$A" < "$DIR/big.txt"
+wait_same > "$DIR/out.txt" || fail "large text"
+cmp -s "$DIR/big.txt" "$DIR/out.txt" || fail "large text differs"
+
+kill -0 $PA $PB 2>/dev/null || fail "--sync exited: $(cat "$DIR/a.err" "$DIR/b.err")"
+echo "PASS: sync_test"
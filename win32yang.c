@@ -1,6 +1,6 @@
 /*
  * win32yang - Clipboard tool for Windows
- * Last Change:  2024 Dec 16
+ * Last Change:  2026 Oct 18
  * License:      https://unlicense.org
  * URL:          https://github.com/matveyt/win32yang
  */
@@ -11,261 +11,3093 @@
 #endif // UNICODE
 
 #define WIN32_LEAN_AND_MEAN
+#if !defined(_WIN32_WINNT)
+#define _WIN32_WINNT 0x0600
+#endif // _WIN32_WINNT
 #include <stdbool.h>
 #include <stdint.h>
 #include <tchar.h>
 #include <windows.h>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HAVE_SSE2
+#endif // __SSE2__
+
+
+// raw WideChar "code page"
+#define CP_UTF16 1200
+
+
+// end of line conversion for input
+enum { EOL_KEEP, EOL_CRLF, EOL_LF, EOL_AUTO };
+
+
+// streaming stdin => WideChar
+#define CHUNK_SIZE 65536
+typedef struct {
+    uint32_t cp;        // input code page
+    uint32_t cbMax;     // max bytes per character
+    int eol;            // EOL_xxx
+    bool cr;            // CR held back from the previous chunk (EOL_LF)
+    int c1;             // last byte seen
+    size_t cbCarry;     // incomplete character left from the previous chunk
+    uint8_t* pb;        // converted bytes (2 * CHUNK_SIZE + 8) + raw bytes (CHUNK_SIZE)
+    WCHAR* pw;          // WideChar output (2 * CHUNK_SIZE + 8)
+    unsigned copies;    // COPY_xxx stages done
+} STREAM;
+
+
+// small payload fast path (-i): stdin read ahead and converted without heap
+#define SMALL_SIZE 16384
+static struct {
+    WCHAR wcs[SMALL_SIZE];      // converted text
+    uint8_t buf[SMALL_SIZE];    // stdin bytes read ahead
+    size_t sz;                  // bytes in buf
+    size_t off;                 // bytes of buf passed on to stdin_read()
+    bool eof;                   // all of stdin is in buf
+} small;
+
+
+// synthesized stdin (--replay): read instead of the handle if pb is set
+static struct {
+    const uint8_t* pb;
+    size_t sz;
+} feed;
+
+
+// streaming WideChar => file
+#define SINK_CCH (CHUNK_SIZE / 4)
+#define SINK_SIZE (4 * SINK_CCH + 8)
+typedef struct {
+    HANDLE hOut;        // output file
+    uint32_t cp;        // output code page
+    bool lf;            // CRLF => LF
+    bool raw;           // UTF-16 without --lf: no conversion
+    bool cr;            // CR held back from the previous chunk
+    WCHAR wcHigh;       // high surrogate held back from the previous chunk
+    uint8_t* pb;        // output buffer (SINK_SIZE, allocated on demand if raw)
+    size_t cbOut;       // bytes waiting in pb
+    bool nfc;           // NFC normalization
+    WCHAR* pwQueue;     // normalized text waiting for sink_pass() (SINK_CCH)
+    size_t cchQueue;
+    WCHAR* pwTmp;       // normalized span (cchTmp)
+    size_t cchTmp;
+    WCHAR* pwCarry;     // last starter and what follows (SINK_CCH)
+    size_t cchCarry;
+    const WCHAR* pwCmp; // text to compare against instead of writing (--compare)
+    size_t cchCmp;
+    size_t offCmp;      // WCHARs matched so far
+    bool diff;          // mismatch found
+    unsigned copies;    // COPY_xxx stages done
+} SINK;
+
+
+// payload copy stages of a STREAM or SINK, each counted once (--stats)
+#define COPY_READ       0x01    // stdin => raw bytes
+#define COPY_JOIN       0x02    // raw bytes => carry + bytes (line endings rewritten)
+#define COPY_WIDE       0x04    // bytes => WCHARs
+#define COPY_CONV       0x08    // WCHARs => output bytes
+#define COPY_LF         0x10    // CRLF => LF
+#define COPY_QUEUE      0x20    // normalized text => queue (--nfc)
+#define COPY_WRITE      0x40    // => file
+
+
+// --out=ENC[,lf]:PATH (-o)
+#define MAX_OUT 16
+typedef struct {
+    uint32_t cp;        // output code page
+    bool lf;            // CRLF => LF
+    const _TCHAR* pszPath;
+} OUT_SPEC;
+
+
+// clipboard snapshot file:
+// SNAP_HEADER, SNAP_ENTRY[count], format names (WCHAR), data (SNAP_ALIGN)
+#define SNAP_MAGIC 0x31535957   // "WYS1"
+#define SNAP_ALIGN 16
+typedef struct {
+    uint32_t magic;
+    uint32_t count;     // number of entries
+} SNAP_HEADER;
+typedef struct {
+    uint32_t format;    // clipboard format
+    uint32_t cchName;   // length of the format name (registered formats only)
+    uint64_t offset;    // data offset from the start of file
+    uint64_t size;      // data size in bytes
+} SNAP_ENTRY;
+
+
+// clipboard sync (--sync): SYNC_HEADER followed by size bytes of
+//   SYNC_FULL:   text (WCHARs)
+//   SYNC_DELTA:  SYNC_OP list against the base (last text both sides agreed on)
+//   SYNC_RESYNC: nothing, asks for SYNC_FULL of the base
+#define SYNC_MAGIC 0x31595357   // "WSY1"
+#define SYNC_BLOCK 1024         // WCHARs per delta block
+#define SYNC_DATA UINT64_MAX    // SYNC_OP offset for literal WCHARs
+enum { SYNC_FULL = 1, SYNC_DELTA, SYNC_RESYNC };
+typedef struct {
+    uint32_t magic;
+    uint32_t type;      // SYNC_xxx
+    uint64_t size;      // data size in bytes
+    uint64_t hashBase;  // FNV-1a of the base
+    uint64_t hash;      // FNV-1a of the text
+} SYNC_HEADER;
+typedef struct {
+    uint64_t offset;    // WCHARs from the start of the base or SYNC_DATA
+    uint64_t cch;       // WCHARs to copy (follow the SYNC_OP if SYNC_DATA)
+} SYNC_OP;
+typedef struct {
+    HANDLE hOut;        // peer
+    WCHAR* pwBase;      // base text (heap)
+    size_t cchBase;
+    uint64_t hashBase;
+    bool resync;        // SYNC_RESYNC sent: next SYNC_FULL is taken as is
+} SYNC;
+
+
+// clipboard broadcast ring (--publish, --follow)
+#include "ring.h"
+
+
+// workload trace (WIN32YANG_TRACE=FILE appends a record per run)
+#define TRACE_LF        0x01    // --lf
+#define TRACE_NFC       0x02    // --nfc
+#define TRACE_COMPARE   0x04    // --compare
+#define TRACE_WAIT      0x08    // --wait
+#define TRACE_GREP      0x10    // --grep
+enum { TEXT_EMPTY, TEXT_ASCII, TEXT_BMP, TEXT_WIDE };
+typedef struct {
+    uint64_t time;      // start time (FILETIME)
+    uint32_t usec;      // run time
+    uint32_t cp;        // code page
+    uint64_t cbIn;      // bytes read from stdin or file
+    uint64_t cbOut;     // bytes written to stdout or file
+    uint64_t cchClip;   // WCHARs transferred to or from the clipboard
+    uint16_t action;    // 'i', 'o', 'x', 'c', 's', 'r', 'S', 'P' or 'F' (see _tmain)
+    uint8_t eol;        // EOL_xxx
+    uint8_t flags;      // TRACE_xxx
+    uint8_t cls;        // TEXT_xxx: content class
+    uint8_t reserved[3];
+} TRACE_RECORD;
+
+
+// log-linear latency histogram (--replay)
+// values below HIST_SUB have own buckets, then HIST_SUB buckets per power of two
+#define HIST_SUB 16
+#define HIST_SIZE (HIST_SUB * 30)
+
+
+// run-time statistics (--stats)
+static struct {
+    bool enabled;
+    int64_t tStart;     // QPC ticks at startup
+    int64_t tOpen;      // QPC ticks when the clipboard was opened
+    int64_t tWait;      // total time spent in OpenClipboard()
+    int64_t tHold;      // total time the clipboard was kept open
+    uint32_t nOpen;     // number of OpenClipboard() calls
+    uint64_t cbIn;      // bytes read from stdin or file
+    uint64_t cbOut;     // bytes written to stdout or file
+    uint64_t cchClip;   // WCHARs transferred to or from the clipboard
+    uint32_t nCopy;     // number of times the payload was copied
+    size_t szLive;      // bytes allocated for buffers
+    size_t szPeak;      // max szLive
+    bool eolScan;       // --eol=auto has run
+    int eol;            // EOL_CRLF or EOL_KEEP
+    uint32_t nCRLF;     // CRLFs seen
+    uint32_t nLF;       // lone LFs seen
+    bool trace;         // WIN32YANG_TRACE is set
+    uint64_t ftStart;   // FILETIME at startup (trace only)
+    int cls;            // TEXT_xxx (trace only)
+} stats;
 
 
 // forward prototypes
-static void* stdio_read(size_t* psz, bool crlf);
-static void stdio_write(void* ptr, size_t sz, bool lf);
-static HANDLE mb2wc(uint32_t cp, const void* pSrc, size_t cchSrc);
-static void* wc2mb(uint32_t cp, HANDLE hUCS, size_t* psz);
+static bool small_fill(void);
+static int stdin_eol(uint32_t cp);
+static HANDLE stdio_small(uint32_t cp, int eol);
+static HANDLE stdin_text(uint32_t cp, int eol, bool nfc);
+static HANDLE stdio_read(size_t* psz, int eol, bool wide);
+static DWORD stdin_read(void* ptr, DWORD cb);
+static DWORD stdin_raw(void* ptr, DWORD cb);
+static void stdin_feed(const void* ptr, size_t sz);
+static int stdio_compare(uint32_t cp, int eol, bool nfc, const WCHAR* pClip, size_t cchClip,
+    size_t* poff);
+static void stream_open(STREAM* ps, uint32_t cp, int eol);
+static size_t stream_read(STREAM* ps);
+static void stream_close(STREAM* ps);
+static void sink_open(SINK* ps, HANDLE hOut, uint32_t cp, bool lf, bool nfc);
+static void sink_write(SINK* ps, const WCHAR* pw, size_t cch);
+static void sink_nfc(SINK* ps, const WCHAR* pw, size_t cch);
+static void sink_queue(SINK* ps, const WCHAR* pw, size_t cch);
+static void sink_pass(SINK* ps, const WCHAR* pw, size_t cch);
+static void sink_put(SINK* ps, const WCHAR* pw, size_t cch);
+static void sink_flush(SINK* ps);
+static void sink_close(SINK* ps);
+static void sink_fanout(SINK* ps, size_t nSink, const WCHAR* pw, size_t cch);
+static void sink_grep(SINK* ps, size_t nSink, const WCHAR* pw, size_t cch, const WCHAR* pat,
+    size_t cchPat, bool invert);
+static size_t lf2crlf(uint8_t* pOut, const uint8_t* pIn, size_t sz, int* pc1);
+static size_t wcs_lf2crlf(WCHAR* pOut, const WCHAR* pIn, size_t cch, int* pc1);
+static size_t crlf2lf(uint8_t* pb, size_t sz, bool* pcr);
+static size_t wcs_crlf2lf(WCHAR* pw, size_t cch, bool* pcr);
+static HANDLE wcs_terminate(HANDLE hBuf, size_t cch, int eol);
+static size_t wcs_lone_lf(const WCHAR* pw, size_t cch, int eol);
+static int eol_detect(const uint8_t* ptr, size_t sz);
+static HANDLE wcs_nfc(HANDLE hUCS);
+static WCHAR* wcs_nfc_heap(WCHAR* pw, size_t* pcch);
+static size_t wcs_scan(const WCHAR* pw, size_t cch, WCHAR wcMin);
+static int wcs_class(const WCHAR* pw, size_t cch);
+static size_t nfc_span(const WCHAR* pw, size_t cch, WCHAR** ppTmp, size_t* pcchTmp);
+static bool clip_open(void);
+static void clip_close(void);
+static HWND clip_listen(void);
+static void clip_unlisten(HWND hwnd);
+static bool clip_wait(uint32_t timeout);
+static void clip_set(HANDLE hUCS);
+static WCHAR* clip_text(size_t* pcch);
+static WCHAR* clip_text_seq(DWORD dwSeq, size_t* pcch);
+static bool clip_print(SINK* pk, size_t nSink, const WCHAR* pat, size_t cchPat,
+    bool invert);
+static bool clip_dump(SINK* ps);
+static int clip_save(const _TCHAR* pszFile);
+static int clip_restore(const _TCHAR* pszFile);
+static int clip_sync(void);
+static DWORD WINAPI sync_reader(LPVOID pv);
+static void sync_local(SYNC* ps);
+static void sync_remote(SYNC* ps, const SYNC_HEADER* pHdr);
+static void sync_send(SYNC* ps, uint32_t type, const void* ptr, uint64_t size, uint64_t hash);
+static size_t sync_delta(const SYNC* ps, const WCHAR* pw, size_t cch, uint8_t* pb, size_t cbMax);
+static HANDLE sync_apply(const SYNC* ps, const uint8_t* pb, size_t sz, size_t* pcch);
+static uint64_t fnv1a(const WCHAR* pw, size_t cch);
+static bool is_hglobal(uint32_t format);
+static int clip_publish(void);
+static int clip_follow(uint32_t cp, bool lf, bool nfc);
+static void ring_publish(RING_HEADER* pr);
+static const _TCHAR* ring_name(_TCHAR* psz, const _TCHAR* kind);
+static void trace_write(const _TCHAR* pszFile, int action, uint32_t cp, int eol, int flags);
+static int trace_replay(const _TCHAR* pszFile, uint32_t speed);
+static bool replay_op(const TRACE_RECORD* pRec, HANDLE hNul);
+static void text_fill(WCHAR* pw, size_t cch, int cls, bool lf);
+static bool file_write(HANDLE hFile, const void* ptr, size_t sz);
+static bool file_read(HANDLE hFile, void* ptr, size_t sz);
+static size_t mb_split(uint32_t cp, uint32_t cbMax, const uint8_t* ptr, size_t sz);
+static HANDLE mb2wc(uint32_t cp, HANDLE hBuf, size_t sz);
+static void mem_copy(void* pDst, const void* pSrc, size_t sz);
+static size_t mem_mismatch(const void* ptr1, const void* ptr2, size_t sz);
+static size_t wcs_find(const WCHAR* pw, size_t cch, const WCHAR* pat, size_t cchPat);
+static bool is_ascii(const uint8_t* ptr, size_t sz);
+#if defined(HAVE_SSE2)
+static unsigned popcount16(unsigned x);
+#endif // HAVE_SSE2
+static size_t wcs_trim(const WCHAR* pw, size_t cch);
+static char* utoa(uint64_t n, char* pEnd);
+static const _TCHAR* optval(const _TCHAR* opt, const _TCHAR* name);
+static WCHAR* arg_wcs(const _TCHAR* psz, size_t* pcch);
+static const _TCHAR* arg_out(const _TCHAR* psz, OUT_SPEC* pOut);
+static const _TCHAR* arg_prefix(const _TCHAR* psz, const _TCHAR* prefix);
+static uint32_t atou(const _TCHAR* psz);
+static void stats_print(int action);
+static size_t hist_bucket(uint64_t value);
+static uint64_t hist_value(size_t bucket);
+static uint64_t hist_pct(const uint32_t* hist, uint64_t n, uint32_t permille);
+static char* str_put(char* pOut, const char* psz);
+static char* str_row(char* pOut, const char* name, uint64_t value);
+static int64_t qpc(void);
+static void copy_count(unsigned* pDone, unsigned stages);
+static void* global_alloc(HANDLE* ph, size_t sz);
+static void global_free(HANDLE h);
 static void* heap_alloc(void* ptr, size_t sz);
 static void heap_free(void* ptr);
 
 
 int _tmain(int argc, _TCHAR* argv[])
 {
-    int action = 0;
-    bool crlf = false, lf = false;
-    uint32_t cp = CP_UTF8;
+    int action = 0, ret = 0, eol = EOL_KEEP;
+    bool lf = false, nfc = false, compare = false, wait = false, invert = false;
+    bool bad = false;
+    uint32_t cp = CP_UTF8, cpTo = 0, timeout = INFINITE;
+    const _TCHAR* pszFile = NULL;
+    const _TCHAR* pszGrep = NULL;
+    _TCHAR szTrace[MAX_PATH];
+    uint32_t speed = 1;
+    OUT_SPEC out[MAX_OUT];
+    size_t nOut = 0;
 
+    stats.tStart = qpc();
+    DWORD cchTrace = GetEnvironmentVariable(_T("WIN32YANG_TRACE"), szTrace, MAX_PATH);
+    if (cchTrace > 0 && cchTrace < MAX_PATH) {
+        FILETIME ft;
+        GetSystemTimeAsFileTime(&ft);
+        stats.trace = true;
+        stats.ftStart = ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    }
     for (int optind = 1; optind < argc; ++optind) {
         const _TCHAR* optarg = argv[optind];
+        const _TCHAR* val;
         if (*optarg++ == _T('-')) {
             switch (*optarg++) {
             case _T('i'):
             case _T('o'):
             case _T('x'):
+            case _T('c'):
                 if (optarg[0] == 0)
                     action = optarg[-1];
             break;
+            case _T('v'):
+                if (optarg[0] == 0)
+                    invert = true;
+            break;
             case _T('-'):
                 if (!lstrcmp(optarg, _T("crlf")))
-                    crlf = true;
+                    eol = EOL_CRLF;
                 else if (!lstrcmp(optarg, _T("lf")))
                     lf = true;
+                else if (!lstrcmp(optarg, _T("eol=auto")))
+                    eol = EOL_AUTO;
+                else if (!lstrcmp(optarg, _T("eol=crlf")))
+                    eol = EOL_CRLF;
+                else if (!lstrcmp(optarg, _T("eol=lf")))
+                    eol = EOL_LF;
+                else if (!lstrcmp(optarg, _T("eol=keep")))
+                    eol = EOL_KEEP;
+                else if (!lstrcmp(optarg, _T("nfc")))
+                    nfc = true;
+                else if (!lstrcmp(optarg, _T("compare")))
+                    compare = true;
+                else if ((!lstrcmp(optarg, _T("save")) || !lstrcmp(optarg, _T("restore")))
+                    && optind + 1 < argc) {
+                    action = optarg[0];
+                    pszFile = argv[++optind];
+                } else if (!lstrcmp(optarg, _T("sync")))
+                    action = _T('S');
+                else if (!lstrcmp(optarg, _T("publish")))
+                    action = _T('P');
+                else if (!lstrcmp(optarg, _T("follow")))
+                    action = _T('F');
+                else if (!lstrcmp(optarg, _T("replay")) && optind + 1 < argc) {
+                    action = _T('R');
+                    pszFile = argv[++optind];
+                } else if ((val = optval(optarg, _T("speed"))) != NULL && *val != 0)
+                    speed = atou(val);
+                else if ((val = optval(optarg, _T("wait"))) != NULL) {
+                    wait = true;
+                    if (*val != 0)
+                        timeout = atou(val);
+                } else if ((val = optval(optarg, _T("grep"))) != NULL && *val != 0)
+                    pszGrep = val;
+                else if ((val = optval(optarg, _T("out"))) != NULL) {
+                    if (nOut < MAX_OUT && arg_out(val, &out[nOut]) != NULL)
+                        ++nOut;
+                    else
+                        bad = true;
+                }
+                else if (!lstrcmp(optarg, _T("stats")))
+                    stats.enabled = true;
                 else if (!lstrcmp(optarg, _T("acp")))
                     cp = GetACP();
                 else if (!lstrcmp(optarg, _T("oem")))
                     cp = GetOEMCP();
                 else if (!lstrcmp(optarg, _T("utf8")))
                     cp = CP_UTF8;
+                else if (!lstrcmp(optarg, _T("utf16")))
+                    cp = CP_UTF16;
+                else if (!lstrcmp(optarg, _T("to=acp")))
+                    cpTo = GetACP();
+                else if (!lstrcmp(optarg, _T("to=oem")))
+                    cpTo = GetOEMCP();
+                else if (!lstrcmp(optarg, _T("to=utf8")))
+                    cpTo = CP_UTF8;
+                else if (!lstrcmp(optarg, _T("to=utf16")))
+                    cpTo = CP_UTF16;
             break;
             }
         }
     }
 
-    switch (action) {
-        HANDLE hUCS;
+    // --eol=auto: decide once for all paths that read stdin
+    if (eol == EOL_AUTO && (action == _T('i') || action == _T('c')))
+        eol = stdin_eol(cp);
+
+    switch (bad ? 0 : action) {
         void* ptr;
         size_t sz;
 
     case _T('i'):
-        // stdin => clipboard
-        ptr = stdio_read(&sz, crlf);
-        hUCS = mb2wc(cp, ptr, sz);
-        heap_free(ptr);
-        if (OpenClipboard(NULL)) {
-            EmptyClipboard();
-            if (SetClipboardData(CF_UNICODETEXT, hUCS) == NULL)
-                GlobalFree(hUCS);   // release HANDLE on failure
-            CloseClipboard();
+        if (compare) {
+            // stdin <=> clipboard (released before stdin is read)
+            ret = 2;
+            ptr = clip_text(&sz);
+            if (ptr != NULL) {
+                ret = stdio_compare(cp, eol, nfc, ptr, sz, &sz);
+                heap_free(ptr);
+            }
+            if (ret == 1) {
+                // print offset of the first difference
+                char buf[24], *pEnd = buf + sizeof(buf);
+                *--pEnd = '\n';
+                ptr = utoa(sz, pEnd);
+                WriteFile(GetStdHandle(STD_OUTPUT_HANDLE), ptr, (DWORD)(buf + sizeof(buf)
+                    - (char*)ptr), &(DWORD){0}, NULL);
+            }
+            break;
         }
+
+        // stdin => clipboard
+        clip_set(stdin_text(cp, eol, nfc));
     break;
 
     case _T('o'):
-        // clipboard => stdout
-        if (OpenClipboard(NULL)) {
-            hUCS = GetClipboardData(CF_UNICODETEXT);
-            if (hUCS == NULL) {
-                CloseClipboard();
-                break;
+        // wait for the next change
+        if (wait && !clip_wait(timeout)) {
+            ret = 1;
+            break;
+        }
+
+        // clipboard => stdout or --out files
+        {
+            SINK k[MAX_OUT];
+            size_t nSink = 0, cchPat = 0;
+            WCHAR* pat = (pszGrep != NULL) ? arg_wcs(pszGrep, &cchPat) : NULL;
+            if (nOut == 0)
+                sink_open(&k[nSink++], GetStdHandle(STD_OUTPUT_HANDLE), cp, lf, nfc);
+            for (size_t i = 0; i < nOut; ++i) {
+                HANDLE hFile = CreateFile(out[i].pszPath, GENERIC_WRITE, 0, NULL,
+                    CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+                if (hFile != INVALID_HANDLE_VALUE)
+                    sink_open(&k[nSink++], hFile, out[i].cp, out[i].lf, nfc);
+                else
+                    ret = 1;
             }
-            ptr = wc2mb(cp, hUCS, &sz);
-            CloseClipboard();
-            stdio_write(ptr, sz, lf);
-            heap_free(ptr);
+            if (nSink > 0)
+                clip_print(k, nSink, pat, cchPat, invert);
+            for (size_t i = 0; i < nSink; ++i) {
+                sink_close(&k[i]);
+                if (nOut > 0)
+                    CloseHandle(k[i].hOut);
+            }
+            if (pat != NULL)
+                heap_free(pat);
+        }
+    break;
+
+    case _T('c'):
+        // stdin => stdout (no clipboard)
+        {
+            STREAM st;
+            SINK k;
+            size_t cch;
+            stream_open(&st, cp, eol);
+            sink_open(&k, GetStdHandle(STD_OUTPUT_HANDLE), (cpTo != 0) ? cpTo : cp, lf,
+                nfc);
+            while ((cch = stream_read(&st)) > 0)
+                sink_write(&k, st.pw, cch);
+            sink_close(&k);
+            stream_close(&st);
         }
     break;
 
     case _T('x'):
         // delete clipboard
-        if (OpenClipboard(NULL)) {
+        if (clip_open()) {
             EmptyClipboard();
-            CloseClipboard();
+            clip_close();
         }
     break;
 
+    case _T('s'):
+        // clipboard => file
+        ret = clip_save(pszFile);
+    break;
+
+    case _T('r'):
+        // file => clipboard
+        ret = clip_restore(pszFile);
+    break;
+
+    case _T('S'):
+        // clipboard <=> stdin/stdout
+        ret = clip_sync();
+    break;
+
+    case _T('P'):
+        // clipboard => ring
+        ret = clip_publish();
+    break;
+
+    case _T('F'):
+        // ring => stdout
+        ret = clip_follow(cp, lf, nfc);
+    break;
+
+    case _T('R'):
+        // trace => clipboard
+        ret = trace_replay(pszFile, speed);
+    break;
+
     default:
 #define STR(a) (a), (sizeof(a) - sizeof(*a))
         WriteFile(GetStdHandle(STD_ERROR_HANDLE), STR(
             "Invalid arguments\n\n"
             "Usage:\n"
-            "\twin32yang -i [--crlf]\n"
-            "\twin32yang -o [--lf]\n"
+            "\twin32yang -i [--eol=auto|crlf|lf|keep] [--nfc] [--compare]\n"
+            "\twin32yang -o [--lf] [--nfc] [--wait[=ms]] [--grep=LITERAL [-v]]\n"
+            "\t             [--out=ENC[,lf]:PATH]...\n"
             "\twin32yang -x\n"
+            "\twin32yang -c [--eol=auto|crlf|lf|keep] [--lf] [--nfc] [--to=ENC]\n"
+            "\twin32yang --save FILE\n"
+            "\twin32yang --restore FILE\n"
+            "\twin32yang --replay FILE [--speed=N]\n"
+            "\twin32yang --sync\n"
+            "\twin32yang --publish\n"
+            "\twin32yang --follow [--lf] [--nfc]\n"
             "\n"
             "Options:\n"
             "\t-i\t\tSet clipboard from stdin\n"
             "\t-o\t\tPrint clipboard contents to stdout\n"
             "\t-x\t\tDelete clipboard\n"
-            "\t--crlf\t\tReplace lone LF bytes with CRLF before setting the clipboard\n"
+            "\t-c\t\tConvert stdin to stdout without the clipboard\n"
+            "\t--save\t\tSave all clipboard formats to FILE\n"
+            "\t--restore\tRestore clipboard from FILE\n"
+            "\t--sync\t\tMirror clipboard with a peer over stdin/stdout\n"
+            "\t--publish\tBroadcast clipboard changes to local --follow readers\n"
+            "\t--follow\tPrint every published change followed by NUL\n"
+            "\t--replay\tReplay WIN32YANG_TRACE file and print latency percentiles\n"
+            "\t--speed=N\tReplay N times faster (0 for no delays, default 1)\n"
+            "\t--eol=auto\tReplace lone LFs with CRLF unless the input starts as CRLF\n"
+            "\t--eol=crlf\tReplace lone LFs with CRLF (same as --crlf)\n"
+            "\t--eol=lf\tReplace CRLF with LF before setting the clipboard\n"
+            "\t--eol=keep\tKeep line endings as is (default)\n"
             "\t--lf\t\tReplace CRLF with LF before printing to stdout\n"
+            "\t--nfc\t\tNormalize text to Unicode NFC\n"
+            "\t--compare\tCompare stdin against the clipboard instead of setting it\n"
+            "\t--grep\t\tPrint only lines containing LITERAL (case-sensitive)\n"
+            "\t-v\t\tPrint only lines not containing LITERAL\n"
+            "\t--wait[=ms]\tWait for the next clipboard change before printing it\n"
+            "\t--out\t\tWrite to PATH in acp, oem, utf8 or utf16 instead of stdout\n"
             "\t--acp\t\tAssume CP_ACP (system ANSI code page) encoding\n"
             "\t--oem\t\tAssume CP_OEMCP (OEM code page) encoding\n"
             "\t--utf8\t\tAssume CP_UTF8 encoding (default)\n"
+            "\t--utf16\t\tAssume raw UTF-16LE encoding\n"
+            "\t--to=ENC\tWrite acp, oem, utf8 or utf16 with -c (default: same as input)\n"
+            "\t--stats\t\tPrint statistics to stderr\n"
         ), &(DWORD){0}, NULL);
-    break;
+        return ret;
     }
 
-    return 0;
+    if (stats.trace && action != _T('R'))
+        trace_write(szTrace, action, cp, eol, (lf ? TRACE_LF : 0) | (nfc ? TRACE_NFC : 0)
+            | (compare ? TRACE_COMPARE : 0) | (wait ? TRACE_WAIT : 0)
+            | (pszGrep != NULL ? TRACE_GREP : 0));
+    if (stats.enabled)
+        stats_print(action);
+    return ret;
+}
+
+
+// stdin => small.buf
+// returns true if all of stdin is there
+bool small_fill(void)
+{
+    while (!small.eof && small.sz < SMALL_SIZE) {
+        DWORD cbRead = stdin_raw(small.buf + small.sz, (DWORD)(SMALL_SIZE - small.sz));
+        small.sz += cbRead;
+        small.eof = cbRead == 0;
+    }
+    return small.eof;
+}
+
+
+// --eol=auto: line endings in the first SMALL_SIZE bytes of stdin decide for all of it
+// returns EOL_KEEP if they are all CRLF, EOL_CRLF otherwise
+int stdin_eol(uint32_t cp)
+{
+    small_fill();
+    if (cp == CP_UTF16) {
+        wcs_lone_lf((const WCHAR*)small.buf, small.sz / sizeof(WCHAR), EOL_AUTO);
+        return stats.eol;
+    }
+    return eol_detect(small.buf, small.sz);
+}
+
+
+// stdin => clipboard text (-i and --replay)
+HANDLE stdin_text(uint32_t cp, int eol, bool nfc)
+{
+    HANDLE hBuf, hUCS = stdio_small(cp, eol);
+    size_t sz;
+    if (hUCS != NULL) {
+        // fits into small.buf
+    } else if (cp == CP_UTF16) {
+        // use stdin buffer as is
+        hBuf = stdio_read(&sz, EOL_KEEP, false);
+        hUCS = wcs_terminate(hBuf, sz / sizeof(WCHAR), eol);
+    } else {
+        // convert in place
+        hBuf = stdio_read(&sz, eol, true);
+        hUCS = mb2wc(cp, hBuf, sz);
+    }
+    if (nfc)
+        hUCS = wcs_nfc(hUCS);
+    return hUCS;
+}
+
+
+// stdin => clipboard text if it fits into small.buf
+// no heap and a single GlobalAlloc of the exact size
+// returns NULL otherwise (bytes read ahead are left for stdin_read())
+HANDLE stdio_small(uint32_t cp, int eol)
+{
+    if (!small_fill())
+        return NULL;
+    stats.cbIn += small.sz;
+    small.off = small.sz;
+
+    WCHAR* pw = small.wcs;
+    size_t cch;
+    if (cp == CP_UTF16) {
+        pw = (WCHAR*)small.buf;
+        cch = small.sz / sizeof(WCHAR);
+    } else {
+        cch = (size_t)MultiByteToWideChar(cp, 0, (const char*)small.buf, (int)small.sz,
+            pw, SMALL_SIZE);
+        ++stats.nCopy;
+    }
+
+    size_t n = 0;
+    if (eol == EOL_LF) {
+        // CRLF => LF
+        bool cr;
+        cch = wcs_crlf2lf(pw, cch, &cr);
+        if (cr)
+            pw[cch++] = '\r';
+    } else {
+        n = wcs_lone_lf(pw, cch, eol);
+    }
+
+    // exact size is known now
+    HANDLE hUCS = NULL;
+    WCHAR* pOut = global_alloc(&hUCS, sizeof(WCHAR) * (cch + n + 1));
+    if (n > 0) {
+        int c1 = 0;
+        wcs_lf2crlf(pOut, pw, cch, &c1);
+    } else {
+        mem_copy(pOut, pw, sizeof(WCHAR) * cch);
+    }
+    pOut[cch + n] = 0;
+    GlobalUnlock(hUCS);
+
+    stats.cchClip += cch + n;
+    stats.nCopy += 2;
+    return hUCS;
 }
 
 
-// stdin => buffer (heap_alloc)
-void* stdio_read(size_t* psz, bool crlf)
+// stdin => buffer (GlobalAlloc)
+// if wide is set then there is a room left to convert it to WideChar in place
+HANDLE stdio_read(size_t* psz, int eol, bool wide)
 {
-    void* ptr = NULL;
+    HANDLE hBuf = NULL;
     uint8_t* pOut = NULL;
     size_t szDone = 0, szHole = 0, szTail = 0;
     size_t szIncr = 2048;
+    int c1 = 0;
+    bool cr = false;
 
     for (;;) {
         // ptr => szDone + szHole + szTail
         //        pOut---^        ^---pIn
         // szHole is a number of extra bytes between pOut and pIn
-        // reserved for LF => CRLF expansion
-        // if crlf == FALSE then szHole = 0; otherwise szHole = szIncr >= cbRead
+        // reserved for LF => CRLF expansion (EOL_CRLF)
+        // or a CR held back (EOL_LF); otherwise szHole = 0
         // szTail is a number of free bytes at the end of a buffer
         // to make room for ReadFile(): szTail >= szIncr >= cbRead
 
-        size_t szIncr2 = szIncr + (crlf ? szIncr : 0);
+        bool crlf = eol == EOL_CRLF;
+        // one extra byte for a CR held back
+        size_t szIncr2 = szIncr + (crlf ? szIncr : 1);
         if (szHole + szTail < szIncr2) {
-            // grow buffer
-            szIncr += szIncr;
-            szTail += szIncr2 + szIncr2;
-            ptr = heap_alloc(ptr, szDone + szHole + szTail);
-            pOut = (uint8_t*)ptr + szDone;
+            // grow buffer by half, reads up to CHUNK_SIZE
+            if (szIncr < CHUNK_SIZE) {
+                szIncr += szIncr;
+                szIncr2 = szIncr + (crlf ? szIncr : 1);
+            }
+            size_t szGrow = (szDone + szHole + szTail) / 2;
+            szTail += (szGrow > szIncr2) ? szGrow : szIncr2;
+            if (hBuf != NULL)
+                GlobalUnlock(hBuf);
+            pOut = (uint8_t*)global_alloc(&hBuf, szDone + szHole + szTail) + szDone;
         }
 
         if (crlf && szHole < szIncr) {
             // grow hole
             szTail -= szIncr - szHole;
             szHole = szIncr;
+        } else if (cr) {
+            // put CR back
+            *pOut = '\r';
+            --szTail;
+            szHole = 1;
         }
 
         // read szIncr bytes
         uint8_t* pIn = pOut + szHole;
-        DWORD cbRead;
-        ReadFile(GetStdHandle(STD_INPUT_HANDLE), pIn, (DWORD)szIncr, &cbRead, NULL);
+        DWORD cbRead = stdin_read(pIn, (DWORD)szIncr);
         // test EOF or error
         if (cbRead == 0)
             break;
-        szDone += cbRead;
+        stats.cbIn += cbRead;
         szTail -= cbRead;
 
-        if (crlf) {
+        size_t cbOut = cbRead;
+        if (eol == EOL_CRLF) {
             // LF => CRLF
-            int c1 = 0;
-            do {
-                int c = *pIn++;
-                if (c1 == '\r' || c != '\n') {
-                    *pOut++ = (uint8_t)c;
-                } else {
-                    *pOut++ = '\r';
-                    *pOut++ = '\n';
-                    --szHole;
-                    ++szDone;
-                }
-                c1 = c;
-            } while (--cbRead);
-        } else {
-            pOut += cbRead;
+            cbOut = lf2crlf(pOut, pIn, cbRead, &c1);
+            szHole -= cbOut - cbRead;
+        } else if (eol == EOL_LF) {
+            // CRLF => LF
+            cbOut = crlf2lf(pOut, szHole + cbRead, &cr);
+            szTail += szHole + cbRead - cbOut;
+            szHole = 0;
         }
+        szDone += cbOut;
+        pOut += cbOut;
+    }
+
+    if (cr) {
+        // trailing CR
+        ++szDone;
+        szHole = 0;
+    }
+    GlobalUnlock(hBuf);
+    if (wide && szHole + szTail < szDone + 2) {
+        // WideChar needs twice as much, which is grown to only now
+        global_alloc(&hBuf, 2 * szDone + 2);
+        GlobalUnlock(hBuf);
     }
+    if (szDone > 0)
+        stats.nCopy += (eol == EOL_CRLF || eol == EOL_LF) ? 2 : 1;
+    return *psz = szDone, hBuf;
+}
+
 
-    return *psz = szDone, ptr;
+// stdin => ptr (bytes read ahead by stdio_small() go first)
+// returns 0 on EOF or error
+DWORD stdin_read(void* ptr, DWORD cb)
+{
+    DWORD cbRead = 0;
+    if (small.off < small.sz) {
+        cbRead = (small.sz - small.off < cb) ? (DWORD)(small.sz - small.off) : cb;
+        mem_copy(ptr, small.buf + small.off, cbRead);
+        small.off += cbRead;
+    } else {
+        cbRead = stdin_raw(ptr, cb);
+    }
+    return cbRead;
 }
 
 
-// buffer => stdout
-void stdio_write(void* ptr, size_t sz, bool lf)
+// stdin handle or synthesized stdin => ptr
+DWORD stdin_raw(void* ptr, DWORD cb)
 {
-    uint8_t* pOut = ptr;
+    DWORD cbRead = 0;
+    if (feed.pb != NULL) {
+        cbRead = (feed.sz < cb) ? (DWORD)feed.sz : cb;
+        mem_copy(ptr, feed.pb, cbRead);
+        feed.pb += cbRead;
+        feed.sz -= cbRead;
+    } else {
+        ReadFile(GetStdHandle(STD_INPUT_HANDLE), ptr, cb, &cbRead, NULL);
+    }
+    return cbRead;
+}
 
-    if (lf) {
-        // CRLF => LF
-        uint8_t* pIn;
-        size_t szTail;
-        for (pIn = pOut, szTail = sz; szTail >= 2; --szTail) {
-            // at least two bytes left to look ahead
-            int c = *pIn++;
-            if (c != '\r' || *pIn != '\n') {
-                *pOut++ = (uint8_t)c;
+
+// serve sz bytes at ptr as stdin from the start (--replay)
+void stdin_feed(const void* ptr, size_t sz)
+{
+    small.sz = 0;
+    small.off = 0;
+    small.eof = false;
+    feed.pb = ptr;
+    feed.sz = sz;
+}
+
+
+// stdin <=> WideChar
+// stream chunks go through a sink, so --nfc is applied as with -c
+// returns 0 if equal, 1 if different (*poff is set to the offset in WCHARs)
+int stdio_compare(uint32_t cp, int eol, bool nfc, const WCHAR* pClip, size_t cchClip,
+    size_t* poff)
+{
+    size_t cch;
+    STREAM s;
+    SINK k;
+
+    stream_open(&s, cp, eol);
+    sink_open(&k, NULL, CP_UTF16, false, nfc);
+    k.pwCmp = pClip;
+    k.cchCmp = cchClip;
+    // stop at the first difference
+    while (!k.diff && (cch = stream_read(&s)) > 0)
+        sink_write(&k, s.pw, cch);
+    sink_close(&k);
+    stream_close(&s);
+
+    return *poff = k.offCmp, (k.diff || k.offCmp < cchClip);
+}
+
+
+// prepare stream
+void stream_open(STREAM* ps, uint32_t cp, int eol)
+{
+    CPINFO cpi;
+    ps->cp = cp;
+    ps->cbMax = (cp == CP_UTF8) ? 4 : GetCPInfo(cp, &cpi) ? cpi.MaxCharSize : 1;
+    ps->eol = eol;
+    ps->cr = false;
+    ps->c1 = 0;
+    ps->cbCarry = 0;
+    ps->pb = heap_alloc(NULL, 3 * CHUNK_SIZE + 8);
+    ps->pw = heap_alloc(NULL, sizeof(WCHAR) * (2 * CHUNK_SIZE + 8));
+    ps->copies = 0;
+}
+
+
+// stdin => WideChar chunk (ps->pw)
+// returns a number of WCHARs or 0 on EOF
+size_t stream_read(STREAM* ps)
+{
+    for (;;) {
+        // ps->pb => cbCarry + converted bytes
+        // raw bytes are read past the end of converted ones
+        uint8_t* pIn = ps->pb + 2 * CHUNK_SIZE + 8;
+        uint8_t* pOut = ps->pb + ps->cbCarry;
+        DWORD cbRead = stdin_read(pIn, CHUNK_SIZE);
+        stats.cbIn += cbRead;
+        if (cbRead > 0)
+            copy_count(&ps->copies, COPY_READ | COPY_JOIN);
+
+        size_t sz = ps->cbCarry, szDone, cch;
+        if (ps->cp == CP_UTF16) {
+            // raw WCHARs: odd byte is kept for the next chunk
+            mem_copy(pOut, pIn, cbRead);
+            sz += cbRead;
+            szDone = sz & ~(size_t)1;
+        } else if (cbRead > 0) {
+            if (ps->eol == EOL_CRLF) {
+                sz += lf2crlf(pOut, pIn, cbRead, &ps->c1);
+            } else if (ps->eol == EOL_LF) {
+                // CR held back goes first
+                *pOut = '\r';
+                mem_copy(pOut + ps->cr, pIn, cbRead);
+                sz += crlf2lf(pOut, ps->cr + cbRead, &ps->cr);
             } else {
-                *pOut++ = '\n';
-                ++pIn;
-                --szTail;
-                --sz;
+                mem_copy(pOut, pIn, cbRead);
+                sz += cbRead;
             }
+            // keep incomplete character for the next chunk
+            szDone = mb_split(ps->cp, ps->cbMax, ps->pb, sz);
+        } else {
+            // EOF: flush whatever is left
+            if (ps->cr)
+                ps->pb[sz++] = '\r';
+            ps->cr = false;
+            szDone = sz;
+        }
+
+        if (szDone == 0) {
+            if (cbRead == 0 && !ps->cr)
+                return 0;
+            ps->cbCarry = sz;
+            if (cbRead > 0)
+                continue;
+        }
+
+        copy_count(&ps->copies, COPY_WIDE);
+        if (ps->cp != CP_UTF16) {
+            cch = (size_t)MultiByteToWideChar(ps->cp, 0, (const char*)ps->pb, (int)szDone,
+                ps->pw, 2 * CHUNK_SIZE + 8);
+        } else if (ps->eol == EOL_CRLF) {
+            cch = wcs_lf2crlf(ps->pw, (const WCHAR*)ps->pb, szDone / sizeof(WCHAR),
+                &ps->c1);
+        } else if (ps->eol == EOL_LF) {
+            // CR held back goes first (or alone on EOF)
+            ps->pw[0] = '\r';
+            mem_copy(ps->pw + ps->cr, ps->pb, szDone);
+            cch = ps->cr + szDone / sizeof(WCHAR);
+            if (cbRead > 0)
+                cch = wcs_crlf2lf(ps->pw, cch, &ps->cr);
+            else
+                ps->cr = false;
+        } else {
+            cch = szDone / sizeof(WCHAR);
+            mem_copy(ps->pw, ps->pb, szDone);
+        }
+        ps->cbCarry = sz - szDone;
+        for (size_t i = 0; i < ps->cbCarry; ++i)
+            ps->pb[i] = ps->pb[szDone + i];
+        // a lone CR may be held back
+        if (cch > 0)
+            return cch;
+    }
+}
+
+
+// release stream
+void stream_close(STREAM* ps)
+{
+    heap_free(ps->pb);
+    heap_free(ps->pw);
+}
+
+
+// prepare sink
+void sink_open(SINK* ps, HANDLE hOut, uint32_t cp, bool lf, bool nfc)
+{
+    ps->hOut = hOut;
+    ps->cp = cp;
+    ps->lf = lf;
+    ps->cr = false;
+    ps->wcHigh = 0;
+    ps->raw = cp == CP_UTF16 && !lf;
+    ps->pb = ps->raw ? NULL : heap_alloc(NULL, SINK_SIZE);
+    ps->cbOut = 0;
+    ps->nfc = nfc;
+    ps->pwQueue = nfc ? heap_alloc(NULL, sizeof(WCHAR) * SINK_CCH) : NULL;
+    ps->cchQueue = 0;
+    ps->pwTmp = NULL;
+    ps->cchTmp = 0;
+    ps->pwCarry = nfc ? heap_alloc(NULL, sizeof(WCHAR) * SINK_CCH) : NULL;
+    ps->cchCarry = 0;
+    ps->pwCmp = NULL;
+    ps->cchCmp = 0;
+    ps->offCmp = 0;
+    ps->diff = false;
+    ps->copies = 0;
+}
+
+
+// WideChar => file
+void sink_write(SINK* ps, const WCHAR* pw, size_t cch)
+{
+    if (!ps->nfc) {
+        sink_pass(ps, pw, cch);
+        return;
+    }
+
+    if (ps->cchCarry > 0) {
+        // carried span goes on with leading WCHARs >= U+0300
+        size_t n = 0;
+        while (n < cch && pw[n] >= 0x300 && ps->cchCarry + n < SINK_CCH)
+            ++n;
+        mem_copy(ps->pwCarry + ps->cchCarry, pw, sizeof(WCHAR) * n);
+        ps->cchCarry += n;
+        pw += n;
+        cch -= n;
+        if (cch == 0 && ps->cchCarry < SINK_CCH)
+            return;
+        sink_nfc(ps, ps->pwCarry, ps->cchCarry);
+        ps->cchCarry = 0;
+    }
+
+    // hold back the last starter and what follows for the next call
+    size_t t = cch;
+    while (t > 0 && cch - t < SINK_CCH && pw[t - 1] >= 0x300)
+        --t;
+    if (cch - t < SINK_CCH) {
+        if (t > 0)
+            --t;
+        mem_copy(ps->pwCarry, pw + t, sizeof(WCHAR) * (cch - t));
+        ps->cchCarry = cch - t;
+        cch = t;
+    }
+    sink_nfc(ps, pw, cch);
+}
+
+
+// NFC spans => sink_queue()
+void sink_nfc(SINK* ps, const WCHAR* pw, size_t cch)
+{
+    // pw => [pass] [span]
+    //       ^-pStart    ^---pw + e
+    const WCHAR* pStart = pw;
+    size_t i;
+    while ((i = wcs_scan(pw, cch, 0x300)) < cch) {
+        size_t b = i > 0, e = i;
+        while (e < cch && pw[e] >= 0x300)
+            ++e;
+        size_t n = nfc_span(pw + i - b, e - i + b, &ps->pwTmp, &ps->cchTmp);
+        if (n > 0) {
+            sink_queue(ps, pStart, (size_t)(pw - pStart) + i - b);
+            sink_queue(ps, ps->pwTmp, n);
+            pStart = pw + e;
+        }
+        pw += e;
+        cch -= e;
+    }
+    sink_queue(ps, pStart, (size_t)(pw - pStart) + cch);
+}
+
+
+// queue up normalized text to keep writes large
+void sink_queue(SINK* ps, const WCHAR* pw, size_t cch)
+{
+    if (ps->cchQueue + cch > SINK_CCH) {
+        sink_pass(ps, ps->pwQueue, ps->cchQueue);
+        ps->cchQueue = 0;
+        if (cch > SINK_CCH / 2) {
+            sink_pass(ps, pw, cch);
+            return;
+        }
+    }
+    if (cch > 0)
+        copy_count(&ps->copies, COPY_QUEUE);
+    mem_copy(ps->pwQueue + ps->cchQueue, pw, sizeof(WCHAR) * cch);
+    ps->cchQueue += cch;
+}
+
+
+// WideChar => sink_put() pieces
+void sink_pass(SINK* ps, const WCHAR* pw, size_t cch)
+{
+    if (ps->pwCmp != NULL) {
+        // --compare: match instead of writing
+        size_t n = (cch < ps->cchCmp - ps->offCmp) ? cch : ps->cchCmp - ps->offCmp;
+        size_t cchSame = ps->diff ? 0 : mem_mismatch(pw, ps->pwCmp + ps->offCmp,
+            sizeof(WCHAR) * n) / sizeof(WCHAR);
+        ps->offCmp += cchSame;
+        ps->diff |= cchSame < cch;
+        stats.cchClip += cchSame;
+        return;
+    }
+    if (ps->raw) {
+        // raw WCHARs: large pieces are written as is, small ones (--grep lines) gathered
+        size_t sz = sizeof(WCHAR) * cch;
+        if (ps->cbOut + sz > SINK_SIZE)
+            sink_flush(ps);
+        if (sz > SINK_SIZE / 2) {
+            copy_count(&ps->copies, COPY_WRITE);
+            file_write(ps->hOut, pw, sz);
+        } else if (sz > 0) {
+            if (ps->pb == NULL)
+                ps->pb = heap_alloc(NULL, SINK_SIZE);
+            copy_count(&ps->copies, COPY_CONV);
+            mem_copy(ps->pb + ps->cbOut, pw, sz);
+            ps->cbOut += sz;
         }
-        // pass last byte through
-        if (szTail > 0)
-            *pOut++ = *pIn;
+        return;
+    }
+
+    // keep surrogate pairs together
+    if (ps->wcHigh != 0 && cch > 0) {
+        WCHAR pair[2] = { ps->wcHigh, pw[0] };
+        bool low = (pw[0] & 0xFC00) == 0xDC00;
+        ps->wcHigh = 0;
+        sink_put(ps, pair, low ? 2 : 1);
+        if (low)
+            ++pw, --cch;
+    }
+    if (cch > 0 && (pw[cch - 1] & 0xFC00) == 0xD800)
+        ps->wcHigh = pw[--cch];
+
+    while (cch > 0) {
+        size_t n = (cch < SINK_CCH) ? cch : SINK_CCH;
+        if (n < cch && (pw[n - 1] & 0xFC00) == 0xD800)
+            --n;
+        sink_put(ps, pw, n);
+        pw += n;
+        cch -= n;
+    }
+}
+
+
+// convert a piece of up to SINK_CCH WCHARs into the output buffer
+// the buffer is written when the next piece may not fit
+void sink_put(SINK* ps, const WCHAR* pw, size_t cch)
+{
+    // a CR held back goes first
+    size_t cbCR = !ps->cr ? 0 : (ps->cp == CP_UTF16) ? sizeof(WCHAR) : 1;
+    if (ps->cbOut + cbCR + 4 * cch > SINK_SIZE)
+        sink_flush(ps);
+    uint8_t* pb = ps->pb + ps->cbOut;
+    size_t sz;
+
+    copy_count(&ps->copies, COPY_CONV | (ps->lf ? COPY_LF : 0));
+    if (ps->cp == CP_UTF16) {
+        sz = sizeof(WCHAR) * cch;
+        mem_copy(pb + cbCR, pw, sz);
     } else {
-        pOut += sz;
+        sz = (size_t)WideCharToMultiByte(ps->cp, 0, pw, (int)cch, (char*)pb + cbCR,
+            (int)(SINK_SIZE - ps->cbOut - cbCR), NULL, NULL);
     }
 
-    // chop trailing zeroes
-    if (sz > 0)
-        while (*--pOut == 0 && --sz) ;
+    if (ps->lf) {
+        // CRLF => LF
+        if (ps->cp == CP_UTF16) {
+            if (cbCR > 0)
+                *(WCHAR*)pb = '\r';
+            sz = sizeof(WCHAR) * wcs_crlf2lf((WCHAR*)pb, (cbCR + sz) / sizeof(WCHAR),
+                &ps->cr);
+        } else {
+            if (cbCR > 0)
+                *pb = '\r';
+            sz = crlf2lf(pb, cbCR + sz, &ps->cr);
+        }
+    }
 
-    WriteFile(GetStdHandle(STD_OUTPUT_HANDLE), ptr, (DWORD)sz, &(DWORD){0}, NULL);
+    ps->cbOut += sz;
 }
 
 
-// MultiByte => WideChar (GlobalAlloc)
-HANDLE mb2wc(uint32_t cp, const void* pSrc, size_t cchSrc)
+// output buffer => file
+void sink_flush(SINK* ps)
 {
-    int cchDst = MultiByteToWideChar(cp, 0, pSrc, (int)cchSrc, NULL, 0) + 1;
-    HANDLE hUCS = GlobalAlloc(GHND, sizeof(WCHAR) * cchDst);
-    MultiByteToWideChar(cp, 0, pSrc, (int)cchSrc, GlobalLock(hUCS), cchDst);
-    GlobalUnlock(hUCS);
-    return hUCS;
+    if (ps->cbOut > 0) {
+        copy_count(&ps->copies, COPY_WRITE);
+        file_write(ps->hOut, ps->pb, ps->cbOut);
+        ps->cbOut = 0;
+    }
 }
 
 
-// WideChar => MultiByte (heap_alloc)
-void* wc2mb(uint32_t cp, HANDLE hUCS, size_t* psz)
+// flush and release sink
+void sink_close(SINK* ps)
 {
-    const void* pSrc = GlobalLock(hUCS);
-    int cchSrc = GlobalSize(hUCS) / sizeof(WCHAR);
-    int cchDst = WideCharToMultiByte(cp, 0, pSrc, cchSrc, NULL, 0, NULL, NULL) + 1;
-    void* ptr = heap_alloc(NULL, cchDst);
-    cchDst = WideCharToMultiByte(cp, 0, pSrc, cchSrc, ptr, cchDst, NULL, NULL);
-    GlobalUnlock(hUCS);
-    return *psz = (size_t)cchDst, ptr;
+    if (ps->nfc) {
+        sink_nfc(ps, ps->pwCarry, ps->cchCarry);
+        sink_pass(ps, ps->pwQueue, ps->cchQueue);
+        heap_free(ps->pwCarry);
+        heap_free(ps->pwQueue);
+        if (ps->pwTmp != NULL)
+            heap_free(ps->pwTmp);
+    }
+    if (ps->wcHigh != 0)
+        sink_put(ps, &ps->wcHigh, 1);
+    sink_flush(ps);
+    if (ps->cr) {
+        static const WCHAR wcCR = '\r';
+        file_write(ps->hOut, &wcCR, (ps->cp == CP_UTF16) ? sizeof(WCHAR) : 1);
+    }
+    if (ps->pb != NULL)
+        heap_free(ps->pb);
+}
+
+
+// write lines containing (or not containing if invert is set) pat
+void sink_grep(SINK* ps, size_t nSink, const WCHAR* pw, size_t cch, const WCHAR* pat,
+    size_t cchPat, bool invert)
+{
+    size_t off = 0, i;
+
+    while ((i = off + wcs_find(pw + off, cch - off, pat, cchPat)) < cch) {
+        // line around the match
+        size_t start = i, end = i + cchPat;
+        while (start > off && pw[start - 1] != '\n')
+            --start;
+        while (end < cch && pw[end - 1] != '\n')
+            ++end;
+        if (invert)
+            sink_fanout(ps, nSink, pw + off, start - off);
+        else
+            sink_fanout(ps, nSink, pw + start, end - start);
+        off = end;
+    }
+    if (invert)
+        sink_fanout(ps, nSink, pw + off, cch - off);
+}
+
+
+// WideChar => nSink sinks
+// slices are small enough to stay in cache while each sink converts them
+void sink_fanout(SINK* ps, size_t nSink, const WCHAR* pw, size_t cch)
+{
+    while (cch > 0) {
+        size_t n = (nSink == 1 || cch < SINK_CCH) ? cch : SINK_CCH;
+        for (size_t i = 0; i < nSink; ++i)
+            sink_write(&ps[i], pw, n);
+        pw += n;
+        cch -= n;
+    }
+}
+
+
+// LF => CRLF (pOut may overlap pIn if there is a hole of sz bytes before it)
+// returns a number of bytes written
+size_t lf2crlf(uint8_t* pOut, const uint8_t* pIn, size_t sz, int* pc1)
+{
+    uint8_t* pStart = pOut;
+    int c1 = *pc1;
+
+    for (; sz > 0; --sz) {
+        int c = *pIn++;
+        if (c1 == '\r' || c != '\n') {
+            *pOut++ = (uint8_t)c;
+        } else {
+            *pOut++ = '\r';
+            *pOut++ = '\n';
+        }
+        c1 = c;
+    }
+
+    *pc1 = c1;
+    return (size_t)(pOut - pStart);
+}
+
+
+// OpenClipboard() with timing
+bool clip_open(void)
+{
+    int64_t t = qpc();
+    bool ok = OpenClipboard(NULL);
+    stats.tOpen = qpc();
+    stats.tWait += stats.tOpen - t;
+    ++stats.nOpen;
+    return ok;
+}
+
+
+// CloseClipboard() with timing
+void clip_close(void)
+{
+    CloseClipboard();
+    stats.tHold += qpc() - stats.tOpen;
+}
+
+
+// clipboard text => clipboard (ownership is passed)
+void clip_set(HANDLE hUCS)
+{
+    if (stats.trace) {
+        const WCHAR* pw = GlobalLock(hUCS);
+        stats.cls = wcs_class(pw, wcs_trim(pw, GlobalSize(hUCS) / sizeof(WCHAR)));
+        GlobalUnlock(hUCS);
+    }
+
+    if (clip_open()) {
+        EmptyClipboard();
+        if (SetClipboardData(CF_UNICODETEXT, hUCS) == NULL)
+            global_free(hUCS);  // release HANDLE on failure
+        clip_close();
+    } else {
+        global_free(hUCS);
+    }
+}
+
+
+// clipboard text => heap (*pcch WCHARs)
+// copy text out to release the clipboard soon; returns NULL if there is no text
+WCHAR* clip_text(size_t* pcch)
+{
+    return clip_text_seq(0, pcch);
+}
+
+
+// clip_text() if the clipboard sequence number is still dwSeq (0 = any)
+WCHAR* clip_text_seq(DWORD dwSeq, size_t* pcch)
+{
+    WCHAR* pw = NULL;
+
+    if (clip_open()) {
+        // nobody can change it while it is open
+        HANDLE hUCS = (dwSeq == 0 || GetClipboardSequenceNumber() == dwSeq)
+            ? GetClipboardData(CF_UNICODETEXT) : NULL;
+        if (hUCS != NULL) {
+            const WCHAR* pwClip = GlobalLock(hUCS);
+            size_t cch = wcs_trim(pwClip, GlobalSize(hUCS) / sizeof(WCHAR));
+            pw = heap_alloc(NULL, sizeof(WCHAR) * cch + 1);
+            mem_copy(pw, pwClip, sizeof(WCHAR) * cch);
+            GlobalUnlock(hUCS);
+            ++stats.nCopy;
+            *pcch = cch;
+        }
+        clip_close();
+    }
+
+    return pw;
+}
+
+
+// clipboard => sinks (only lines with pat if it is not NULL)
+// returns false if there is no text
+bool clip_print(SINK* pk, size_t nSink, const WCHAR* pat, size_t cchPat, bool invert)
+{
+    if (pat == NULL && nSink == 1 && pk->raw && !pk->nfc && pk->pwCmp == NULL
+        && GetFileType(pk->hOut) == FILE_TYPE_DISK)
+        return clip_dump(pk);
+
+    // the clipboard is released before anything is written
+    size_t cch = 0;
+    WCHAR* pw = clip_text(&cch);
+    if (pw == NULL)
+        return false;
+    if (stats.trace)
+        stats.cls = wcs_class(pw, cch);
+    stats.cchClip += cch;
+
+    WCHAR* pwPat = NULL;
+    size_t cchTmp = 0;
+    if (pat != NULL && pk->nfc) {
+        // search text and pattern as they are written: normalized
+        pw = wcs_nfc_heap(pw, &cch);
+        size_t n = nfc_span(pat, cchPat, &pwPat, &cchTmp);
+        if (n > 0) {
+            pat = pwPat;
+            cchPat = n;
+        }
+    }
+
+    if (pat != NULL)
+        sink_grep(pk, nSink, pw, cch, pat, cchPat, invert);
+    else
+        sink_fanout(pk, nSink, pw, cch);
+
+    if (pwPat != NULL)
+        heap_free(pwPat);
+    heap_free(pw);
+    return true;
+}
+
+
+// clipboard => file as is (raw UTF-16 to a disk file)
+// writing straight from the clipboard is the only copy; unlike a pipe, a disk file
+// never waits for a reader, so the clipboard is not held open for long
+// returns false if there is no text
+bool clip_dump(SINK* ps)
+{
+    bool ret = false;
+
+    if (clip_open()) {
+        HANDLE hUCS = GetClipboardData(CF_UNICODETEXT);
+        if (hUCS != NULL) {
+            const WCHAR* pw = GlobalLock(hUCS);
+            size_t cch = wcs_trim(pw, GlobalSize(hUCS) / sizeof(WCHAR));
+            if (stats.trace)
+                stats.cls = wcs_class(pw, cch);
+            stats.cchClip += cch;
+            if (cch > 0) {
+                copy_count(&ps->copies, COPY_WRITE);
+                file_write(ps->hOut, pw, sizeof(WCHAR) * cch);
+            }
+            GlobalUnlock(hUCS);
+            ret = true;
+        }
+        clip_close();
+    }
+
+    return ret;
+}
+
+
+// LF => CRLF (WideChar)
+// returns a number of WCHARs written
+size_t wcs_lf2crlf(WCHAR* pOut, const WCHAR* pIn, size_t cch, int* pc1)
+{
+    WCHAR* pStart = pOut;
+    int c1 = *pc1;
+
+    for (; cch > 0; --cch) {
+        int c = *pIn++;
+        if (c1 == '\r' || c != '\n') {
+            *pOut++ = (WCHAR)c;
+        } else {
+            *pOut++ = '\r';
+            *pOut++ = '\n';
+        }
+        c1 = c;
+    }
+
+    *pc1 = c1;
+    return (size_t)(pOut - pStart);
+}
+
+
+// CRLF => LF (in place)
+// trailing CR is held back (*pcr is set)
+// returns a number of bytes left
+size_t crlf2lf(uint8_t* pb, size_t sz, bool* pcr)
+{
+    uint8_t* pOut = pb;
+
+    *pcr = sz > 0 && pb[sz - 1] == '\r';
+    if (*pcr)
+        --sz;
+    for (size_t i = 0; i < sz; ++i) {
+        if (pb[i] != '\r' || i + 1 == sz || pb[i + 1] != '\n')
+            *pOut++ = pb[i];
+    }
+
+    return (size_t)(pOut - pb);
+}
+
+
+// CRLF => LF (WideChar, in place)
+// trailing CR is held back (*pcr is set)
+// returns a number of WCHARs left
+size_t wcs_crlf2lf(WCHAR* pw, size_t cch, bool* pcr)
+{
+    WCHAR* pOut = pw;
+
+    *pcr = cch > 0 && pw[cch - 1] == '\r';
+    if (*pcr)
+        --cch;
+    for (size_t i = 0; i < cch; ++i) {
+        if (pw[i] != '\r' || i + 1 == cch || pw[i + 1] != '\n')
+            *pOut++ = pw[i];
+    }
+
+    return (size_t)(pOut - pw);
+}
+
+
+// WideChar buffer => clipboard text (EOL_xxx conversion and NUL terminator)
+HANDLE wcs_terminate(HANDLE hBuf, size_t cch, int eol)
+{
+    size_t n = 0;
+
+    if (eol == EOL_LF) {
+        // CRLF => LF
+        bool cr;
+        WCHAR* pw = GlobalLock(hBuf);
+        size_t cchOut = wcs_crlf2lf(pw, cch, &cr);
+        if (cr)
+            pw[cchOut++] = '\r';
+        GlobalUnlock(hBuf);
+        if (cchOut < cch)
+            ++stats.nCopy;
+        cch = cchOut;
+    } else if (eol != EOL_KEEP) {
+        n = wcs_lone_lf(GlobalLock(hBuf), cch, eol);
+        GlobalUnlock(hBuf);
+    }
+
+    WCHAR* pw = global_alloc(&hBuf, sizeof(WCHAR) * (cch + n + 1));
+    pw[cch + n] = 0;
+    if (n > 0) {
+        // expand back to front
+        ++stats.nCopy;
+        for (size_t i = cch; n > 0; ) {
+            WCHAR c = pw[--i];
+            pw[i + n] = c;
+            if (c == '\n' && (i == 0 || pw[i - 1] != '\r'))
+                pw[i + --n] = '\r';
+        }
+    }
+    GlobalUnlock(hBuf);
+
+    stats.cchClip += cch;
+    return hBuf;
+}
+
+
+// number of lone LFs to expand (EOL_CRLF or EOL_AUTO) or 0
+// EOL_AUTO also reports line endings in stats; only all CRLF means EOL_KEEP
+size_t wcs_lone_lf(const WCHAR* pw, size_t cch, int eol)
+{
+    size_t n = 0;
+    uint32_t nCRLF = 0;
+
+    if (eol != EOL_CRLF && eol != EOL_AUTO)
+        return 0;
+    for (size_t i = 0; i < cch; ++i) {
+        if (pw[i] == '\n') {
+            if (i > 0 && pw[i - 1] == '\r')
+                ++nCRLF;
+            else
+                ++n;
+        }
+    }
+
+    if (eol == EOL_AUTO) {
+        stats.eol = (nCRLF > 0 && n == 0) ? EOL_KEEP : EOL_CRLF;
+        stats.nCRLF = nCRLF;
+        stats.nLF = (uint32_t)n;
+        stats.eolScan = true;
+    }
+    return n;
+}
+
+
+// count line endings (--eol=auto)
+// returns EOL_KEEP if there are CRLFs and no lone LFs, EOL_CRLF otherwise
+int eol_detect(const uint8_t* ptr, size_t sz)
+{
+    uint32_t nCRLF = 0, nLF = 0;
+    unsigned cr = 0;    // previous byte is CR
+    size_t i = 0;
+
+#if defined(HAVE_SSE2)
+    const __m128i vCR = _mm_set1_epi8('\r');
+    const __m128i vLF = _mm_set1_epi8('\n');
+    for (; i + 16 <= sz; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(ptr + i));
+        unsigned mCR = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, vCR));
+        unsigned mLF = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, vLF));
+        unsigned mCRLF = mLF & ((mCR << 1) | cr);
+        nCRLF += popcount16(mCRLF);
+        nLF += popcount16(mLF & ~mCRLF);
+        cr = mCR >> 15;
+    }
+#endif // HAVE_SSE2
+    for (; i < sz; ++i) {
+        if (ptr[i] == '\n') {
+            if (cr)
+                ++nCRLF;
+            else
+                ++nLF;
+        }
+        cr = ptr[i] == '\r';
+    }
+
+    stats.eol = (nCRLF > 0 && nLF == 0) ? EOL_KEEP : EOL_CRLF;
+    stats.nCRLF = nCRLF;
+    stats.nLF = nLF;
+    stats.eolScan = true;
+    return stats.eol;
+}
+
+
+// NFC in place (unlocked clipboard text)
+// only spans failing the quick check are rewritten
+HANDLE wcs_nfc(HANDLE hUCS)
+{
+    WCHAR* pw = GlobalLock(hUCS);
+    size_t cch = wcs_trim(pw, GlobalSize(hUCS) / sizeof(WCHAR));
+    size_t i = wcs_scan(pw, cch, 0x300), o = i;
+
+    if (i == cch) {
+        GlobalUnlock(hUCS);
+        return hUCS;
+    }
+
+    WCHAR* pwTmp = NULL;
+    size_t cchTmp = 0;
+    while (i < cch) {
+        // span: previous starter + WCHARs >= U+0300
+        size_t b = i > 0, e = i;
+        while (e < cch && pw[e] >= 0x300)
+            ++e;
+        size_t n = nfc_span(pw + i - b, e - i + b, &pwTmp, &cchTmp);
+        if (n > 0) {
+            if (o - b + n > e) {
+                // output outgrows input: move the rest up
+                // with a quarter more room, so it is moved a few times at most
+                size_t d = o - b + n - e + cch / 4;
+                GlobalUnlock(hUCS);
+                pw = global_alloc(&hUCS, sizeof(WCHAR) * (cch + d + 1));
+                for (size_t k = cch + 1; k-- > e; )
+                    pw[k + d] = pw[k];
+                cch += d;
+                e += d;
+            }
+            mem_copy(pw + o - b, pwTmp, sizeof(WCHAR) * n);
+            o += n - b;
+        } else {
+            mem_copy(pw + o, pw + i, sizeof(WCHAR) * (e - i));
+            o += e - i;
+        }
+        // pass normalized WCHARs through
+        i = e + wcs_scan(pw + e, cch - e, 0x300);
+        mem_copy(pw + o, pw + e, sizeof(WCHAR) * (i - e));
+        o += i - e;
+    }
+    if (pwTmp != NULL)
+        heap_free(pwTmp);
+
+    GlobalUnlock(hUCS);
+    if (o < cch) {
+        pw = global_alloc(&hUCS, sizeof(WCHAR) * (o + 1));
+        pw[o] = 0;
+        GlobalUnlock(hUCS);
+    }
+    return hUCS;
+}
+
+
+// offset of the first WCHAR >= wcMin or cch if none
+// (anything below U+0300 is NFC already)
+size_t wcs_scan(const WCHAR* pw, size_t cch, WCHAR wcMin)
+{
+    size_t i = 0;
+
+#if defined(HAVE_SSE2)
+    const __m128i vMax = _mm_set1_epi16((short)(wcMin - 1));
+    for (; i + 8 <= cch; i += 8) {
+        __m128i x = _mm_subs_epu16(_mm_loadu_si128((const __m128i*)(pw + i)), vMax);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(x, _mm_setzero_si128())) != 0xFFFF)
+            break;
+    }
+#endif // HAVE_SSE2
+    while (i < cch && pw[i] < wcMin)
+        ++i;
+
+    return i;
+}
+
+
+// content class of WideChar text (TEXT_WIDE is U+D800 and above, incl. surrogates)
+int wcs_class(const WCHAR* pw, size_t cch)
+{
+    size_t i = wcs_scan(pw, cch, 0x80);
+    return (cch == 0) ? TEXT_EMPTY : (i == cch) ? TEXT_ASCII
+        : (i + wcs_scan(pw + i, cch - i, 0xD800) == cch) ? TEXT_BMP : TEXT_WIDE;
+}
+
+
+// NFC of heap text (*pcch WCHARs) by way of wcs_nfc()
+WCHAR* wcs_nfc_heap(WCHAR* pw, size_t* pcch)
+{
+    HANDLE hUCS = NULL;
+    WCHAR* pwNFC = global_alloc(&hUCS, sizeof(WCHAR) * (*pcch + 1));
+    mem_copy(pwNFC, pw, sizeof(WCHAR) * *pcch);
+    pwNFC[*pcch] = 0;
+    GlobalUnlock(hUCS);
+
+    hUCS = wcs_nfc(hUCS);
+    pwNFC = GlobalLock(hUCS);
+    *pcch = wcs_trim(pwNFC, GlobalSize(hUCS) / sizeof(WCHAR));
+    pw = heap_alloc(pw, sizeof(WCHAR) * *pcch + 1);
+    mem_copy(pw, pwNFC, sizeof(WCHAR) * *pcch);
+    GlobalUnlock(hUCS);
+    global_free(hUCS);
+    ++stats.nCopy;
+    return pw;
+}
+
+
+// NFC span => *ppTmp (grown as needed)
+// returns a number of WCHARs or 0 if the span is left as is
+size_t nfc_span(const WCHAR* pw, size_t cch, WCHAR** ppTmp, size_t* pcchTmp)
+{
+    if (IsNormalizedString(NormalizationC, pw, (int)cch))
+        return 0;
+
+    for (size_t cchNeed = 3 * cch + 8; ; cchNeed += cchNeed) {
+        if (*pcchTmp < cchNeed) {
+            *ppTmp = heap_alloc(*ppTmp, sizeof(WCHAR) * cchNeed);
+            *pcchTmp = cchNeed;
+        }
+        int n = NormalizeString(NormalizationC, pw, (int)cch, *ppTmp, (int)*pcchTmp);
+        if (n > 0)
+            return (size_t)n;
+        // invalid UTF-16 is left as is
+        if (GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+            return 0;
+    }
+}
+
+
+// message-only window to listen to WM_CLIPBOARDUPDATE
+// returns NULL on failure
+HWND clip_listen(void)
+{
+    HWND hwnd = CreateWindowEx(0, _T("STATIC"), NULL, 0, 0, 0, 0, 0, HWND_MESSAGE, NULL,
+        NULL, NULL);
+    if (hwnd != NULL)
+        AddClipboardFormatListener(hwnd);
+    return hwnd;
+}
+
+
+// stop listening and destroy the window from clip_listen()
+void clip_unlisten(HWND hwnd)
+{
+    if (hwnd != NULL) {
+        RemoveClipboardFormatListener(hwnd);
+        DestroyWindow(hwnd);
+    }
+}
+
+
+// wait until the clipboard changes and has some text in it
+// returns false on timeout
+bool clip_wait(uint32_t timeout)
+{
+    DWORD dwSeq = GetClipboardSequenceNumber();
+    DWORD dwStart = GetTickCount();
+    bool changed = false;
+
+    HWND hwnd = clip_listen();
+    if (hwnd == NULL)
+        return false;
+
+    for (;;) {
+        MSG msg;
+        while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE))
+            DispatchMessage(&msg);
+
+        // test sequence number in case the change happened before listening
+        DWORD dwSeq2 = GetClipboardSequenceNumber();
+        if (dwSeq2 != dwSeq) {
+            dwSeq = dwSeq2;
+            if (IsClipboardFormatAvailable(CF_UNICODETEXT)) {
+                changed = true;
+                break;
+            }
+        }
+
+        // sleep until the next message arrives
+        DWORD dwWait = timeout;
+        if (timeout != INFINITE) {
+            DWORD dwElapsed = GetTickCount() - dwStart;
+            if (dwElapsed >= timeout)
+                break;
+            dwWait -= dwElapsed;
+        }
+        MsgWaitForMultipleObjects(0, NULL, FALSE, dwWait, QS_ALLINPUT);
+    }
+
+    clip_unlisten(hwnd);
+    return changed;
+}
+
+
+// clipboard => file
+// returns 0 on success
+int clip_save(const _TCHAR* pszFile)
+{
+    int ret = 1;
+    if (!clip_open())
+        return ret;
+
+    // count formats
+    uint32_t count = 0, format = 0;
+    while ((format = EnumClipboardFormats(format)) != 0)
+        ++count;
+
+    // get handles, sizes and names
+    size_t szIndex = sizeof(SNAP_ENTRY) * count;
+    SNAP_ENTRY* pEntry = heap_alloc(NULL, szIndex + sizeof(HANDLE) * count
+        + sizeof(WCHAR) * 256 * count);
+    HANDLE* pHandle = (HANDLE*)((uint8_t*)pEntry + szIndex);
+    WCHAR* pNames = (WCHAR*)(pHandle + count);
+    size_t cchNames = 0;
+    SNAP_HEADER hdr = { SNAP_MAGIC, 0 };
+    while ((format = EnumClipboardFormats(format)) != 0 && hdr.count < count) {
+        HANDLE h;
+        if (!is_hglobal(format) || (h = GetClipboardData(format)) == NULL)
+            continue;
+        SNAP_ENTRY* pe = &pEntry[hdr.count];
+        pe->format = format;
+        pe->cchName = (format >= 0xC000) ? (uint32_t)GetClipboardFormatNameW(format,
+            pNames + cchNames, 256) : 0;
+        pe->size = GlobalSize(h);
+        if (pe->size == 0)
+            continue;
+        cchNames += pe->cchName;
+        pHandle[hdr.count++] = h;
+    }
+
+    // data offsets
+    uint64_t offset = sizeof(hdr) + sizeof(SNAP_ENTRY) * hdr.count
+        + sizeof(WCHAR) * cchNames;
+    for (uint32_t i = 0; i < hdr.count; ++i) {
+        offset = (offset + SNAP_ALIGN - 1) & ~(uint64_t)(SNAP_ALIGN - 1);
+        pEntry[i].offset = offset;
+        offset += pEntry[i].size;
+    }
+
+    HANDLE hFile = CreateFile(pszFile, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile != INVALID_HANDLE_VALUE) {
+        static const uint8_t pad[SNAP_ALIGN];
+        bool ok = file_write(hFile, &hdr, sizeof(hdr))
+            && file_write(hFile, pEntry, sizeof(SNAP_ENTRY) * hdr.count)
+            && file_write(hFile, pNames, sizeof(WCHAR) * cchNames);
+        offset = sizeof(hdr) + sizeof(SNAP_ENTRY) * hdr.count + sizeof(WCHAR) * cchNames;
+        for (uint32_t i = 0; ok && i < hdr.count; ++i) {
+            // write straight from the locked handle
+            const void* ptr = GlobalLock(pHandle[i]);
+            ok = ptr != NULL
+                && file_write(hFile, pad, (size_t)(pEntry[i].offset - offset))
+                && file_write(hFile, ptr, (size_t)pEntry[i].size);
+            GlobalUnlock(pHandle[i]);
+            offset = pEntry[i].offset + pEntry[i].size;
+        }
+        CloseHandle(hFile);
+        ++stats.nCopy;
+        if (ok)
+            ret = 0;
+    }
+
+    clip_close();
+    heap_free(pEntry);
+    return ret;
+}
+
+
+// file => clipboard
+// returns 0 on success
+int clip_restore(const _TCHAR* pszFile)
+{
+    int ret = 1;
+    HANDLE hFile = CreateFile(pszFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return ret;
+
+    LARGE_INTEGER li;
+    HANDLE hMap = NULL;
+    const uint8_t* pView = NULL;
+    if (GetFileSizeEx(hFile, &li) && (uint64_t)li.QuadPart >= sizeof(SNAP_HEADER)
+        && (uint64_t)li.QuadPart <= SIZE_MAX
+        && (hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL)) != NULL)
+        pView = MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+    if (pView == NULL)
+        goto done;
+
+    // validate index
+    uint64_t szFile = (uint64_t)li.QuadPart;
+    const SNAP_HEADER* pHdr = (const SNAP_HEADER*)pView;
+    const SNAP_ENTRY* pEntry = (const SNAP_ENTRY*)(pHdr + 1);
+    uint64_t offset = sizeof(SNAP_HEADER) + sizeof(SNAP_ENTRY) * (uint64_t)pHdr->count;
+    if (pHdr->magic != SNAP_MAGIC || offset > szFile)
+        goto done;
+    for (uint32_t i = 0; i < pHdr->count; ++i) {
+        offset += sizeof(WCHAR) * (uint64_t)pEntry[i].cchName;
+        if (pEntry[i].cchName > 255 || pEntry[i].offset > szFile
+            || pEntry[i].size > szFile - pEntry[i].offset)
+            goto done;
+    }
+    if (offset > szFile)
+        goto done;
+
+    // copy mapped data into GlobalAlloc blocks
+    if (clip_open()) {
+        const WCHAR* pName = (const WCHAR*)(pEntry + pHdr->count);
+        EmptyClipboard();
+        for (uint32_t i = 0; i < pHdr->count; ++i) {
+            uint32_t format = pEntry[i].format;
+            if (pEntry[i].cchName > 0) {
+                WCHAR szName[256];
+                mem_copy(szName, pName, sizeof(WCHAR) * pEntry[i].cchName);
+                szName[pEntry[i].cchName] = 0;
+                pName += pEntry[i].cchName;
+                format = RegisterClipboardFormatW(szName);
+            }
+            HANDLE h = GlobalAlloc(GMEM_MOVEABLE, (size_t)pEntry[i].size);
+            if (h == NULL)
+                continue;
+            mem_copy(GlobalLock(h), pView + pEntry[i].offset, (size_t)pEntry[i].size);
+            stats.cbIn += pEntry[i].size;
+            GlobalUnlock(h);
+            if (format == 0 || SetClipboardData(format, h) == NULL)
+                GlobalFree(h);  // release HANDLE on failure
+        }
+        clip_close();
+        ++stats.nCopy;
+        ret = 0;
+    }
+
+done:
+    if (pView != NULL)
+        UnmapViewOfFile(pView);
+    if (hMap != NULL)
+        CloseHandle(hMap);
+    CloseHandle(hFile);
+    return ret;
+}
+
+
+// clipboard <=> peer until stdin is closed
+// returns 0 on EOF or 1 on a broken stream
+int clip_sync(void)
+{
+    SYNC s = { GetStdHandle(STD_OUTPUT_HANDLE), NULL, 0, fnv1a(NULL, 0), false };
+    int ret = 1;
+
+    HWND hwnd = clip_listen();
+    if (hwnd == NULL)
+        return ret;
+
+    // stdin is read by another thread (message queue must exist already)
+    MSG msg;
+    PeekMessage(&msg, NULL, 0, 0, PM_NOREMOVE);
+    HANDLE hThread = CreateThread(NULL, 0, sync_reader,
+        (LPVOID)(uintptr_t)GetCurrentThreadId(), 0, NULL);
+    if (hThread != NULL) {
+        CloseHandle(hThread);
+        while (GetMessage(&msg, NULL, 0, 0) > 0) {
+            if (msg.message == WM_CLIPBOARDUPDATE) {
+                sync_local(&s);
+            } else if (msg.message == WM_APP) {
+                SYNC_HEADER* pHdr = (SYNC_HEADER*)msg.lParam;
+                if (pHdr == NULL) {
+                    ret = (int)msg.wParam;
+                    break;
+                }
+                sync_remote(&s, pHdr);
+                HeapFree(GetProcessHeap(), 0, pHdr);
+            } else {
+                DispatchMessage(&msg);
+            }
+        }
+    }
+
+    clip_unlisten(hwnd);
+    if (s.pwBase != NULL)
+        heap_free(s.pwBase);
+    return ret;
+}
+
+
+// stdin => WM_APP (lParam is SYNC_HEADER + data, not accounted as it is another thread)
+// lParam is NULL on EOF (wParam = 0) or a broken stream (wParam = 1)
+DWORD WINAPI sync_reader(LPVOID pv)
+{
+    DWORD idThread = (DWORD)(uintptr_t)pv;
+    HANDLE hIn = GetStdHandle(STD_INPUT_HANDLE);
+    SYNC_HEADER hdr;
+
+    while (file_read(hIn, &hdr, sizeof(hdr))) {
+        SYNC_HEADER* pHdr = NULL;
+        if (hdr.magic == SYNC_MAGIC && hdr.size <= SIZE_MAX - sizeof(hdr))
+            pHdr = HeapAlloc(GetProcessHeap(), 0, sizeof(hdr) + (size_t)hdr.size);
+        if (pHdr == NULL || !file_read(hIn, pHdr + 1, (size_t)hdr.size)) {
+            if (pHdr != NULL)
+                HeapFree(GetProcessHeap(), 0, pHdr);
+            PostThreadMessage(idThread, WM_APP, 1, 0);
+            return 1;
+        }
+        *pHdr = hdr;
+        PostThreadMessage(idThread, WM_APP, 0, (LPARAM)pHdr);
+    }
+
+    PostThreadMessage(idThread, WM_APP, 0, 0);
+    return 0;
+}
+
+
+// clipboard changed => peer
+void sync_local(SYNC* ps)
+{
+    size_t cch = 0;
+    WCHAR* pw = clip_text(&cch);
+    if (pw == NULL)
+        return;
+    stats.cchClip += cch;
+
+    // skip own changes and no-op copies
+    uint64_t hash = fnv1a(pw, cch);
+    if (hash == ps->hashBase) {
+        heap_free(pw);
+        return;
+    }
+
+    // send delta unless it is no smaller than text
+    size_t cbMax = sizeof(WCHAR) * cch;
+    uint8_t* pb = heap_alloc(NULL, cbMax + 1);
+    size_t sz = sync_delta(ps, pw, cch, pb, cbMax);
+    if (sz > 0)
+        sync_send(ps, SYNC_DELTA, pb, sz, hash);
+    else
+        sync_send(ps, SYNC_FULL, pw, sizeof(WCHAR) * cch, hash);
+    heap_free(pb);
+
+    // new base
+    if (ps->pwBase != NULL)
+        heap_free(ps->pwBase);
+    ps->pwBase = pw;
+    ps->cchBase = cch;
+    ps->hashBase = hash;
+}
+
+
+// peer => clipboard
+void sync_remote(SYNC* ps, const SYNC_HEADER* pHdr)
+{
+    const uint8_t* pb = (const uint8_t*)(pHdr + 1);
+    size_t sz = (size_t)pHdr->size, cch = 0;
+    HANDLE hUCS = NULL;
+    bool echo = false;
+
+    if (pHdr->type == SYNC_FULL || pHdr->type == SYNC_DELTA) {
+        // SYNC_FULL after own SYNC_RESYNC is the answer
+        bool answer = pHdr->type == SYNC_FULL && ps->resync;
+        if (answer)
+            ps->resync = false;
+        // same text already
+        if (pHdr->hash == ps->hashBase)
+            return;
+        if (!answer && pHdr->hashBase != ps->hashBase) {
+            // both sides changed at once: higher hash wins on both sides
+            if (pHdr->hash < ps->hashBase) {
+                // keep own text and make sure the peer gets it
+                sync_send(ps, SYNC_FULL, ps->pwBase, sizeof(WCHAR) * ps->cchBase,
+                    ps->hashBase);
+                return;
+            }
+            if (pHdr->type == SYNC_DELTA) {
+                // no common base: ask for the text
+                ps->resync = true;
+                sync_send(ps, SYNC_RESYNC, NULL, 0, 0);
+                return;
+            }
+            // peer may have moved on already: send the winner back
+            echo = true;
+        }
+    }
+
+    switch (pHdr->type) {
+    case SYNC_FULL:
+        if (sz % sizeof(WCHAR) == 0) {
+            cch = sz / sizeof(WCHAR);
+            WCHAR* pw = global_alloc(&hUCS, sz + sizeof(WCHAR));
+            mem_copy(pw, pb, sz);
+            pw[cch] = 0;
+            GlobalUnlock(hUCS);
+        }
+    break;
+
+    case SYNC_DELTA:
+        hUCS = sync_apply(ps, pb, sz, &cch);
+    break;
+
+    case SYNC_RESYNC:
+        sync_send(ps, SYNC_FULL, ps->pwBase, sizeof(WCHAR) * ps->cchBase, ps->hashBase);
+        return;
+    }
+
+    // verify and make it the new base
+    const WCHAR* pw = (hUCS != NULL) ? GlobalLock(hUCS) : NULL;
+    if (pw != NULL && fnv1a(pw, cch) == pHdr->hash) {
+        ps->pwBase = heap_alloc(ps->pwBase, sizeof(WCHAR) * cch + 1);
+        mem_copy(ps->pwBase, pw, sizeof(WCHAR) * cch);
+        ps->cchBase = cch;
+        ps->hashBase = pHdr->hash;
+        GlobalUnlock(hUCS);
+        stats.cchClip += cch;
+        clip_set(hUCS);
+        if (echo)
+            sync_send(ps, SYNC_FULL, ps->pwBase, sizeof(WCHAR) * cch, ps->hashBase);
+    } else {
+        if (hUCS != NULL) {
+            GlobalUnlock(hUCS);
+            global_free(hUCS);
+        }
+        ps->resync = true;
+        sync_send(ps, SYNC_RESYNC, NULL, 0, 0);
+    }
+}
+
+
+// message => peer
+void sync_send(SYNC* ps, uint32_t type, const void* ptr, uint64_t size, uint64_t hash)
+{
+    SYNC_HEADER hdr = { SYNC_MAGIC, type, size, ps->hashBase, hash };
+    file_write(ps->hOut, &hdr, sizeof(hdr));
+    file_write(ps->hOut, ptr, (size_t)size);
+}
+
+
+// text => SYNC_OP list against the base (rsync-like, but the base is known locally)
+// returns size in bytes or 0 if it would exceed cbMax
+size_t sync_delta(const SYNC* ps, const WCHAR* pw, size_t cch, uint8_t* pb, size_t cbMax)
+{
+    const WCHAR* pwBase = ps->pwBase;
+    size_t nBlocks = ps->cchBase / SYNC_BLOCK;
+    if (nBlocks == 0 || cch < SYNC_BLOCK)
+        return 0;
+
+    // weak checksum => block (open addressing, one block per checksum)
+    size_t nSlots = 16;
+    while (nSlots < 2 * nBlocks)
+        nSlots += nSlots;
+    uint32_t* pSlot = heap_alloc(NULL, 2 * sizeof(uint32_t) * nSlots);
+    for (size_t j = 0; j < 2 * nSlots; ++j)
+        pSlot[j] = 0;
+    for (size_t k = 0; k < nBlocks; ++k) {
+        uint32_t a = 0, b = 0;
+        for (size_t i = 0; i < SYNC_BLOCK; ++i) {
+            a += pwBase[k * SYNC_BLOCK + i];
+            b += a;
+        }
+        uint32_t weak = (a & 0xFFFF) | (b << 16);
+        size_t j = weak & (nSlots - 1);
+        while (pSlot[2 * j + 1] != 0 && pSlot[2 * j] != weak)
+            j = (j + 1) & (nSlots - 1);
+        if (pSlot[2 * j + 1] == 0) {
+            pSlot[2 * j] = weak;
+            pSlot[2 * j + 1] = (uint32_t)k + 1;
+        }
+    }
+
+    // roll over text: a = sum(x[i]), b = sum((SYNC_BLOCK - i) * x[i])
+    size_t sz = 0, p = 0, lit = 0;
+    uint32_t a = 0, b = 0;
+    bool fresh = true;
+    while (p + SYNC_BLOCK <= cch) {
+        if (fresh) {
+            a = b = 0;
+            for (size_t i = 0; i < SYNC_BLOCK; ++i) {
+                a += pw[p + i];
+                b += a;
+            }
+            fresh = false;
+        }
+
+        uint32_t weak = (a & 0xFFFF) | (b << 16);
+        size_t j = weak & (nSlots - 1), off = SIZE_MAX;
+        while (pSlot[2 * j + 1] != 0 && pSlot[2 * j] != weak)
+            j = (j + 1) & (nSlots - 1);
+        if (pSlot[2 * j + 1] != 0) {
+            off = (pSlot[2 * j + 1] - 1) * (size_t)SYNC_BLOCK;
+            if (mem_mismatch(pw + p, pwBase + off, sizeof(WCHAR) * SYNC_BLOCK)
+                != sizeof(WCHAR) * SYNC_BLOCK)
+                off = SIZE_MAX;
+        }
+
+        if (off == SIZE_MAX) {
+            // next window
+            if (p + SYNC_BLOCK < cch) {
+                a += (uint32_t)pw[p + SYNC_BLOCK] - pw[p];
+                b += a - SYNC_BLOCK * (uint32_t)pw[p];
+            }
+            ++p;
+            continue;
+        }
+
+        // extend the match past the block
+        size_t n = SYNC_BLOCK, nMax = cch - p;
+        if (nMax > ps->cchBase - off)
+            nMax = ps->cchBase - off;
+        n += mem_mismatch(pw + p + n, pwBase + off + n, sizeof(WCHAR) * (nMax - n))
+            / sizeof(WCHAR);
+
+        // literal WCHARs then copy
+        SYNC_OP op[2] = { { SYNC_DATA, p - lit }, { off, n } };
+        size_t cbLit = sizeof(WCHAR) * (p - lit);
+        if (sz + sizeof(op) + cbLit > cbMax)
+            break;
+        mem_copy(pb + sz, &op[0], sizeof(op[0]));
+        mem_copy(pb + sz + sizeof(op[0]), pw + lit, cbLit);
+        mem_copy(pb + sz + sizeof(op[0]) + cbLit, &op[1], sizeof(op[1]));
+        sz += sizeof(op) + cbLit;
+        p += n;
+        lit = p;
+        fresh = true;
+    }
+    heap_free(pSlot);
+
+    // literal tail
+    SYNC_OP op = { SYNC_DATA, cch - lit };
+    size_t cbLit = sizeof(WCHAR) * (cch - lit);
+    if (sz + sizeof(op) + cbLit > cbMax)
+        return 0;
+    mem_copy(pb + sz, &op, sizeof(op));
+    mem_copy(pb + sz + sizeof(op), pw + lit, cbLit);
+    return sz + sizeof(op) + cbLit;
+}
+
+
+// SYNC_OP list + base => clipboard text (GlobalAlloc) or NULL if it is invalid
+HANDLE sync_apply(const SYNC* ps, const uint8_t* pb, size_t sz, size_t* pcch)
+{
+    HANDLE hUCS = NULL;
+    WCHAR* pw = NULL;
+    size_t cch = 0;
+
+    // validate and measure, then copy
+    for (int pass = 0; pass < 2; ++pass) {
+        if (pass > 0)
+            pw = global_alloc(&hUCS, sizeof(WCHAR) * (cch + 1));
+        cch = 0;
+        for (size_t i = 0; i < sz; ) {
+            SYNC_OP op;
+            const void* pSrc;
+            if (sz - i < sizeof(op))
+                return NULL;
+            mem_copy(&op, pb + i, sizeof(op));
+            i += sizeof(op);
+            if (op.offset == SYNC_DATA) {
+                if (op.cch > (sz - i) / sizeof(WCHAR))
+                    return NULL;
+                pSrc = pb + i;
+                i += sizeof(WCHAR) * (size_t)op.cch;
+            } else {
+                if (op.offset > ps->cchBase || op.cch > ps->cchBase - op.offset)
+                    return NULL;
+                pSrc = ps->pwBase + op.offset;
+            }
+            if (pw != NULL)
+                mem_copy(pw + cch, pSrc, sizeof(WCHAR) * (size_t)op.cch);
+            cch += (size_t)op.cch;
+        }
+    }
+
+    pw[cch] = 0;
+    GlobalUnlock(hUCS);
+    return *pcch = cch, hUCS;
+}
+
+
+// FNV-1a hash of WCHARs
+uint64_t fnv1a(const WCHAR* pw, size_t cch)
+{
+    uint64_t hash = 0xCBF29CE484222325;
+    for (size_t i = 0; i < cch; ++i) {
+        hash ^= pw[i];
+        hash *= 0x100000001B3;
+    }
+    return hash;
+}
+
+
+// clipboard changes => ring (--publish)
+int clip_publish(void)
+{
+    _TCHAR szName[MAX_PATH];
+    int ret = 1;
+
+    // single writer
+    HANDLE hMutex = CreateMutex(NULL, FALSE, ring_name(szName, _T("publish")));
+    if (hMutex == NULL)
+        return ret;
+    DWORD dw = WaitForSingleObject(hMutex, 0);
+    if (dw != WAIT_OBJECT_0 && dw != WAIT_ABANDONED) {
+        CloseHandle(hMutex);
+        return ret;
+    }
+
+    // manual-reset event wakes up all readers at once
+    HANDLE hEvent = CreateEvent(NULL, TRUE, FALSE, ring_name(szName, _T("event")));
+    HANDLE hMap = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0,
+        sizeof(RING_HEADER) + RING_SIZE, ring_name(szName, _T("ring")));
+    RING_HEADER* pr = (hMap != NULL) ? MapViewOfFile(hMap, FILE_MAP_WRITE, 0, 0, 0) : NULL;
+    // updates queue up until the ring is ready
+    HWND hwnd = clip_listen();
+
+    if (hEvent != NULL && pr != NULL && hwnd != NULL) {
+        ring_init(pr);
+        MSG msg;
+        while (GetMessage(&msg, NULL, 0, 0) > 0) {
+            if (msg.message == WM_CLIPBOARDUPDATE) {
+                ring_publish(pr);
+                SetEvent(hEvent);
+                ResetEvent(hEvent);
+            } else {
+                DispatchMessage(&msg);
+            }
+        }
+        ret = 0;
+    }
+
+    clip_unlisten(hwnd);
+    if (pr != NULL)
+        UnmapViewOfFile(pr);
+    if (hMap != NULL)
+        CloseHandle(hMap);
+    if (hEvent != NULL)
+        CloseHandle(hEvent);
+    ReleaseMutex(hMutex);
+    CloseHandle(hMutex);
+    return ret;
+}
+
+
+// ring => stdout (--follow)
+// returns 2 if there is no ring, 0 when stdout is closed
+int clip_follow(uint32_t cp, bool lf, bool nfc)
+{
+    _TCHAR szName[MAX_PATH];
+    HANDLE hOut = GetStdHandle(STD_OUTPUT_HANDLE);
+
+    HANDLE hMap = OpenFileMapping(FILE_MAP_READ, FALSE, ring_name(szName, _T("ring")));
+    const RING_HEADER* pr = (hMap != NULL) ? MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0)
+        : NULL;
+    if (pr == NULL || pr->magic != RING_MAGIC || pr->size != RING_SIZE) {
+        if (pr != NULL)
+            UnmapViewOfFile(pr);
+        if (hMap != NULL)
+            CloseHandle(hMap);
+        return 2;
+    }
+    HANDLE hEvent = OpenEvent(SYNCHRONIZE, FALSE, ring_name(szName, _T("event")));
+
+    // start from the next change
+    uint32_t pos = pr->head;
+    RING_RECORD rec;
+    WCHAR* pw = NULL;
+    for (;;) {
+        // no system calls while records are there
+        bool eof = false;
+        while (!eof && ring_next(pr, &pos, &rec, &pw)) {
+            WCHAR* pwText = pw;
+            size_t cch = rec.cch;
+            if (rec.cch < rec.cchText) {
+                // too long: read the clipboard unless it has changed since
+                pwText = clip_text_seq(rec.clipSeq, &cch);
+                if (pwText == NULL)
+                    continue;
+                stats.cchClip += cch;
+            }
+            SINK k;
+            sink_open(&k, hOut, cp, lf, nfc);
+            sink_write(&k, pwText, cch);
+            sink_close(&k);
+            if (pwText != pw)
+                heap_free(pwText);
+            static const WCHAR wcNul = 0;
+            eof = !file_write(hOut, &wcNul, (cp == CP_UTF16) ? sizeof(WCHAR) : 1);
+        }
+        if (eof)
+            break;
+
+        // sleep until the next record
+        if (hEvent != NULL)
+            WaitForSingleObject(hEvent, RING_POLL);
+        else
+            Sleep(RING_POLL);
+    }
+
+    if (pw != NULL)
+        heap_free(pw);
+    if (hEvent != NULL)
+        CloseHandle(hEvent);
+    UnmapViewOfFile(pr);
+    CloseHandle(hMap);
+    return 0;
+}
+
+
+// clipboard text => next ring record
+void ring_publish(RING_HEADER* pr)
+{
+    if (!clip_open())
+        return;
+    HANDLE hUCS = GetClipboardData(CF_UNICODETEXT);
+    if (hUCS != NULL) {
+        const WCHAR* pw = GlobalLock(hUCS);
+        size_t cch = wcs_trim(pw, GlobalSize(hUCS) / sizeof(WCHAR));
+        ring_append(pr, pw, cch, GetClipboardSequenceNumber());
+        GlobalUnlock(hUCS);
+        stats.cchClip += cch;
+    }
+    clip_close();
+}
+
+
+// Local\win32yang-<kind>-<user> => psz (MAX_PATH)
+const _TCHAR* ring_name(_TCHAR* psz, const _TCHAR* kind)
+{
+    static const _TCHAR szPrefix[] = _T("Local\\win32yang-");
+    _TCHAR* p = psz;
+    for (const _TCHAR* q = szPrefix; *q != 0; )
+        *p++ = *q++;
+    while (*kind != 0)
+        *p++ = *kind++;
+    *p++ = _T('-');
+    DWORD cch = MAX_PATH - (DWORD)(p - psz);
+    if (!GetUserName(p, &cch))
+        *p = 0;
+    return psz;
+}
+
+
+// append a record to the trace file
+void trace_write(const _TCHAR* pszFile, int action, uint32_t cp, int eol, int flags)
+{
+    LARGE_INTEGER li;
+    QueryPerformanceFrequency(&li);
+    TRACE_RECORD rec = {
+        .time = stats.ftStart,
+        .usec = (uint32_t)((uint64_t)(qpc() - stats.tStart) * 1000000 / (uint64_t)li.QuadPart),
+        .cp = cp,
+        .cbIn = stats.cbIn,
+        .cbOut = stats.cbOut,
+        .cchClip = stats.cchClip,
+        .action = (uint16_t)action,
+        .eol = (uint8_t)eol,
+        .flags = (uint8_t)flags,
+        .cls = (uint8_t)stats.cls,
+    };
+
+    // appends of a single record do not interleave
+    HANDLE hFile = CreateFile(pszFile, FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile != INVALID_HANDLE_VALUE) {
+        WriteFile(hFile, &rec, sizeof(rec), &(DWORD){0}, NULL);
+        CloseHandle(hFile);
+    }
+}
+
+
+// trace file => clipboard (at the recorded pace divided by speed)
+// returns 0 on success
+int trace_replay(const _TCHAR* pszFile, uint32_t speed)
+{
+    int ret = 1;
+    stats.trace = false;    // replay is not recorded
+    HANDLE hFile = CreateFile(pszFile, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return ret;
+
+    LARGE_INTEGER li;
+    HANDLE hMap = NULL;
+    const TRACE_RECORD* pRec = NULL;
+    if (GetFileSizeEx(hFile, &li) && (uint64_t)li.QuadPart >= sizeof(TRACE_RECORD)
+        && (uint64_t)li.QuadPart <= SIZE_MAX
+        && (hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL)) != NULL)
+        pRec = MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+    if (pRec == NULL)
+        goto done;
+
+    // the clipboard is overwritten: keep a snapshot to put back
+    _TCHAR szDir[MAX_PATH], szSnap[MAX_PATH];
+    if (GetTempPath(MAX_PATH, szDir) == 0 || GetTempFileName(szDir, _T("wy"), 0, szSnap) == 0)
+        goto done;
+    if (clip_save(szSnap) != 0) {
+        DeleteFile(szSnap);
+        goto done;
+    }
+
+    // records may be still appended: ignore a partial one
+    size_t count = (size_t)li.QuadPart / sizeof(TRACE_RECORD);
+    HANDLE hNul = CreateFile(_T("NUL"), GENERIC_WRITE, FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, NULL);
+    uint32_t hist[HIST_SIZE] = {0};
+    uint64_t nDone = 0, usMax = 0;
+    QueryPerformanceFrequency(&li);
+    uint64_t freq = (uint64_t)li.QuadPart;
+    int64_t tStart = qpc();
+
+    for (size_t i = 0; i < count; ++i) {
+        if (speed > 0 && pRec[i].time > pRec[0].time) {
+            // keep the recorded pace
+            uint64_t usDue = (pRec[i].time - pRec[0].time) / 10 / speed;
+            uint64_t usNow = (uint64_t)(qpc() - tStart) * 1000000 / freq;
+            if (usDue > usNow + 1000)
+                Sleep((DWORD)((usDue - usNow) / 1000));
+        }
+
+        int64_t t = qpc();
+        if (!replay_op(&pRec[i], hNul))
+            continue;
+        uint64_t us = (uint64_t)(qpc() - t) * 1000000 / freq;
+        ++hist[hist_bucket(us)];
+        ++nDone;
+        if (usMax < us)
+            usMax = us;
+    }
+
+    uint64_t usTotal = (uint64_t)(qpc() - tStart) * 1000000 / freq;
+    if (usTotal == 0)
+        usTotal = 1;
+    CloseHandle(hNul);
+    clip_restore(szSnap);
+    DeleteFile(szSnap);
+
+    // report
+    char buf[512], *pOut = buf;
+    pOut = str_row(pOut, "records", count);
+    pOut = str_row(pOut, "replayed", nDone);
+    pOut = str_row(pOut, "skipped", count - nDone);
+    pOut = str_row(pOut, "elapsed, us", usTotal);
+    pOut = str_row(pOut, "ops/s", nDone * 1000000 / usTotal);
+    pOut = str_row(pOut, "clipboard KB/s",
+        stats.cchClip * sizeof(WCHAR) * 1000000 / 1024 / usTotal);
+    static const char* const name[] = { "p50, us", "p99, us", "p99.9, us" };
+    static const uint32_t permille[] = { 500, 990, 999 };
+    for (size_t i = 0; i < sizeof(name) / sizeof(*name); ++i) {
+        // bucket bound may be above the actual max
+        uint64_t us = hist_pct(hist, nDone, permille[i]);
+        pOut = str_row(pOut, name[i], (us < usMax) ? us : usMax);
+    }
+    pOut = str_row(pOut, "max, us", usMax);
+    WriteFile(GetStdHandle(STD_OUTPUT_HANDLE), buf, (DWORD)(pOut - buf), &(DWORD){0}, NULL);
+    ret = 0;
+
+done:
+    if (pRec != NULL)
+        UnmapViewOfFile(pRec);
+    if (hMap != NULL)
+        CloseHandle(hMap);
+    CloseHandle(hFile);
+    return ret;
+}
+
+
+// re-issue a traced run with a synthesized payload of the same size and class
+// (stdin and stdout are replaced)
+// returns false if it is skipped: -i --compare, -c, -s, -r, --sync, --publish, --follow
+bool replay_op(const TRACE_RECORD* pRec, HANDLE hNul)
+{
+    bool lf = pRec->flags & TRACE_LF, nfc = pRec->flags & TRACE_NFC;
+    size_t cch = (size_t)pRec->cchClip;
+    uint32_t cp = pRec->cp;
+    int eol = pRec->eol;
+
+    switch (pRec->action) {
+    case 'i': {
+        if (pRec->flags & TRACE_COMPARE)
+            return false;
+        // text => code page => stdin; lone LFs if the run expanded them
+        WCHAR* pw = heap_alloc(NULL, sizeof(WCHAR) * cch + 1);
+        text_fill(pw, cch, pRec->cls, eol == EOL_CRLF);
+        uint8_t* pb = (uint8_t*)pw;
+        size_t sz = sizeof(WCHAR) * cch;
+        if (cp != CP_UTF16) {
+            sz = (size_t)WideCharToMultiByte(cp, 0, pw, (int)cch, NULL, 0, NULL, NULL);
+            pb = heap_alloc(NULL, sz + 1);
+            WideCharToMultiByte(cp, 0, pw, (int)cch, (char*)pb, (int)sz, NULL, NULL);
+        }
+        stdin_feed(pb, sz);
+
+        if (eol == EOL_AUTO)
+            eol = stdin_eol(cp);
+        clip_set(stdin_text(cp, eol, nfc));
+
+        stdin_feed(NULL, 0);
+        if (pb != (uint8_t*)pw)
+            heap_free(pb);
+        heap_free(pw);
+    }
+    break;
+
+    case 'o': {
+        SINK k;
+        sink_open(&k, hNul, cp, lf, nfc);
+        clip_print(&k, 1, NULL, 0, false);
+        sink_close(&k);
+    }
+    break;
+
+    case 'x':
+        if (clip_open()) {
+            EmptyClipboard();
+            clip_close();
+        }
+    break;
+
+    default:
+        return false;
+    }
+
+    return true;
+}
+
+
+// synthesize text of a content class (TEXT_xxx)
+// lines end in CRLF or in LF if lf is set
+void text_fill(WCHAR* pw, size_t cch, int cls, bool lf)
+{
+    uint32_t seed = 1;
+
+    for (size_t i = 0; i < cch; ++i) {
+        seed = seed * 1103515245 + 12345;
+        uint32_t r = seed >> 16;
+        WCHAR c = (WCHAR)('a' + r % 26);
+        if (i % 64 == 63) {
+            // line end every 64 WCHARs
+            c = '\n';
+        } else if (i % 64 == 62 && !lf) {
+            c = '\r';
+        } else if (r % 8 == 0) {
+            c = ' ';
+        } else if (cls >= TEXT_BMP && r % 4 == 1) {
+            // Cyrillic
+            c = (WCHAR)(0x0430 + r % 32);
+        } else if (cls == TEXT_WIDE && r % 4 == 2 && i + 1 < cch && i % 64 < 61) {
+            // U+1F600 and up
+            pw[i++] = 0xD83D;
+            c = (WCHAR)(0xDE00 + r % 64);
+        }
+        pw[i] = c;
+    }
+}
+
+
+// test if clipboard format data is HGLOBAL
+bool is_hglobal(uint32_t format)
+{
+    switch (format) {
+    case CF_BITMAP:
+    case CF_METAFILEPICT:
+    case CF_PALETTE:
+    case CF_ENHMETAFILE:
+    case CF_OWNERDISPLAY:
+    case CF_DSPBITMAP:
+    case CF_DSPMETAFILEPICT:
+    case CF_DSPENHMETAFILE:
+        return false;
+    }
+    // private and GDI object formats are not HGLOBAL either
+    return format < CF_PRIVATEFIRST || format > CF_GDIOBJLAST;
+}
+
+
+// file => buffer (all of sz bytes)
+bool file_read(HANDLE hFile, void* ptr, size_t sz)
+{
+    uint8_t* pb = ptr;
+    while (sz > 0) {
+        DWORD cbRead = (sz < 0x40000000) ? (DWORD)sz : 0x40000000, cbDone;
+        if (!ReadFile(hFile, pb, cbRead, &cbDone, NULL) || cbDone == 0)
+            return false;
+        pb += cbDone;
+        sz -= cbDone;
+        stats.cbIn += cbDone;
+    }
+    return true;
+}
+
+
+// buffer => file
+bool file_write(HANDLE hFile, const void* ptr, size_t sz)
+{
+    const uint8_t* pb = ptr;
+    while (sz > 0) {
+        DWORD cbWrite = (sz < 0x40000000) ? (DWORD)sz : 0x40000000, cbDone;
+        if (!WriteFile(hFile, pb, cbWrite, &cbDone, NULL) || cbDone == 0)
+            return false;
+        pb += cbDone;
+        sz -= cbDone;
+        stats.cbOut += cbDone;
+    }
+    return true;
+}
+
+
+// length of a MultiByte string not counting an incomplete trailing character
+size_t mb_split(uint32_t cp, uint32_t cbMax, const uint8_t* ptr, size_t sz)
+{
+    size_t i = sz, n = 0;
+
+    if (cp == CP_UTF8) {
+        // skip continuation bytes back to the lead byte
+        while (i > 0 && n < 3 && (ptr[i - 1] & 0xC0) == 0x80)
+            --i, ++n;
+        if (i > 0) {
+            int c = ptr[--i];
+            size_t need = (c >= 0xF0) ? 3 : (c >= 0xE0) ? 2 : (c >= 0xC0) ? 1 : 0;
+            if (need <= n)
+                i = sz;
+        }
+    } else if (cbMax > 1) {
+        // odd number of trailing lead bytes means the last one is incomplete
+        while (n < sz && IsDBCSLeadByteEx(cp, ptr[sz - n - 1]))
+            ++n;
+        if (n & 1)
+            --i;
+    }
+
+    return i;
+}
+
+
+// MultiByte => WideChar in place (hBuf has room for 2 * sz + 2 bytes)
+HANDLE mb2wc(uint32_t cp, HANDLE hBuf, size_t sz)
+{
+    uint8_t* pb = GlobalLock(hBuf);
+    WCHAR* pw = (WCHAR*)pb;
+    size_t cch = 0;
+    CPINFO cpi;
+    uint32_t cbMax = (cp == CP_UTF8) ? 4 : GetCPInfo(cp, &cpi) ? cpi.MaxCharSize : 1;
+
+    if (cbMax == 1 || (cp == CP_UTF8 && is_ascii(pb, sz))) {
+        // one byte per WCHAR: widen back to front
+        uint8_t bytes[256];
+        WCHAR map[256];
+        int n = (cbMax == 1) ? 256 : 128;
+        for (int i = 0; i < n; ++i)
+            bytes[i] = (uint8_t)i;
+        MultiByteToWideChar(cp, 0, (const char*)bytes, n, map, n);
+        for (cch = sz; cch > 0; --cch)
+            pw[cch - 1] = map[pb[cch - 1]];
+        cch = sz;
+    } else if (sz > 0) {
+        // move bytes up and convert front to back
+        const uint8_t* pIn = pb + sz + 2;
+        mem_copy(pb + sz + 2, pb, sz);
+        ++stats.nCopy;
+        while (sz > 0) {
+            // output must not overrun unread input
+            WCHAR buf[256], *pOut = pw + cch;
+            size_t cchRoom = (size_t)(pIn - (uint8_t*)pOut) / sizeof(WCHAR);
+            size_t n = (sz < cchRoom) ? sz : (cchRoom >= 64) ? cchRoom : (sz < 256) ? sz : 256;
+            if (n < sz)
+                n = mb_split(cp, cbMax, pIn, n);
+            if (n > cchRoom)
+                pOut = buf;
+            size_t m = (size_t)MultiByteToWideChar(cp, 0, (const char*)pIn, (int)n, pOut,
+                (int)n);
+            if (pOut == buf)
+                mem_copy(pw + cch, buf, sizeof(WCHAR) * m);
+            cch += m;
+            pIn += n;
+            sz -= n;
+        }
+    }
+
+    pw[cch] = 0;
+    GlobalUnlock(hBuf);
+    global_alloc(&hBuf, sizeof(WCHAR) * (cch + 1));
+    GlobalUnlock(hBuf);
+    stats.cchClip += cch;
+    ++stats.nCopy;
+    return hBuf;
+}
+
+
+// non-overlapping copy (or pDst below pSrc)
+static void mem_copy(void* pDst, const void* pSrc, size_t sz)
+{
+    uint8_t* pd = pDst;
+    const uint8_t* ps = pSrc;
+    size_t i = 0;
+
+#if defined(HAVE_SSE2)
+    for (; i + 16 <= sz; i += 16)
+        _mm_storeu_si128((__m128i*)(pd + i), _mm_loadu_si128((const __m128i*)(ps + i)));
+#endif // HAVE_SSE2
+    for (; i < sz; ++i)
+        pd[i] = ps[i];
+}
+
+
+// offset of the first different byte or sz if none
+static size_t mem_mismatch(const void* ptr1, const void* ptr2, size_t sz)
+{
+    const uint8_t* p1 = ptr1;
+    const uint8_t* p2 = ptr2;
+    size_t i = 0;
+
+#if defined(HAVE_SSE2)
+    for (; i + 16 <= sz; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(p1 + i));
+        __m128i y = _mm_loadu_si128((const __m128i*)(p2 + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xFFFF)
+            break;
+    }
+#endif // HAVE_SSE2
+    while (i < sz && p1[i] == p2[i])
+        ++i;
+
+    return i;
+}
+
+
+// offset of the first occurrence of pat or cch if none
+static size_t wcs_find(const WCHAR* pw, size_t cch, const WCHAR* pat, size_t cchPat)
+{
+    if (cchPat > cch)
+        return cch;
+
+    // pat can start at [0, cchLast)
+    size_t cchLast = cch - cchPat + 1, i = 0;
+#if defined(HAVE_SSE2)
+    // test the first and the last WCHAR at once
+    const __m128i vFirst = _mm_set1_epi16((short)pat[0]);
+    const __m128i vLast = _mm_set1_epi16((short)pat[cchPat - 1]);
+    for (; i + 8 <= cchLast; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(pw + i));
+        __m128i y = _mm_loadu_si128((const __m128i*)(pw + i + cchPat - 1));
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi16(x, vFirst),
+            _mm_cmpeq_epi16(y, vLast)));
+        for (size_t k = i; m != 0; ++k, m >>= 2)
+            if ((m & 1) && mem_mismatch(pw + k, pat, sizeof(WCHAR) * cchPat)
+                == sizeof(WCHAR) * cchPat)
+                return k;
+    }
+#endif // HAVE_SSE2
+    for (; i < cchLast; ++i)
+        if (pw[i] == pat[0] && mem_mismatch(pw + i, pat, sizeof(WCHAR) * cchPat)
+            == sizeof(WCHAR) * cchPat)
+            return i;
+
+    return cch;
+}
+
+
+// test if there are only 7-bit bytes
+static bool is_ascii(const uint8_t* ptr, size_t sz)
+{
+    size_t i = 0;
+
+#if defined(HAVE_SSE2)
+    for (; i + 16 <= sz; i += 16)
+        if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(ptr + i))) != 0)
+            return false;
+#endif // HAVE_SSE2
+    for (; i < sz; ++i)
+        if (ptr[i] & 0x80)
+            return false;
+
+    return true;
+}
+
+
+#if defined(HAVE_SSE2)
+// number of bits set in a 16-bit mask
+static unsigned popcount16(unsigned x)
+{
+    x -= (x >> 1) & 0x5555;
+    x = (x & 0x3333) + ((x >> 2) & 0x3333);
+    x = (x + (x >> 4)) & 0x0F0F;
+    return (x + (x >> 8)) & 0x1F;
+}
+#endif // HAVE_SSE2
+
+
+// length of a WideChar string not counting trailing NULs
+static inline size_t wcs_trim(const WCHAR* pw, size_t cch)
+{
+    while (cch > 0 && pw[cch - 1] == 0)
+        --cch;
+    return cch;
+}
+
+
+// unsigned => decimal (stored backwards ending at pEnd)
+static char* utoa(uint64_t n, char* pEnd)
+{
+    do *--pEnd = (char)('0' + n % 10); while (n /= 10);
+    return pEnd;
+}
+
+
+// statistics => stderr
+static void stats_print(int action)
+{
+    static const char* const name[] = {
+        "bytes in", "bytes out", "clipboard WCHARs", "clipboard opens",
+        "payload copies", "peak memory", "lock wait, us", "lock hold, us", "total time, us",
+        "CRLFs seen", "lone LFs seen",
+    };
+    LARGE_INTEGER li;
+    QueryPerformanceFrequency(&li);
+    uint64_t freq = (uint64_t)li.QuadPart;
+    uint64_t value[] = {
+        stats.cbIn, stats.cbOut, stats.cchClip, stats.nOpen, stats.nCopy, stats.szPeak,
+        (uint64_t)stats.tWait * 1000000 / freq,
+        (uint64_t)stats.tHold * 1000000 / freq,
+        (uint64_t)(qpc() - stats.tStart) * 1000000 / freq,
+        stats.nCRLF, stats.nLF,
+    };
+    size_t n = sizeof(name) / sizeof(*name) - (stats.eolScan ? 0 : 2);
+    char buf[512], *pOut = buf;
+
+    // action letter => option (the last one if not found)
+    static const _TCHAR letter[] = _T("srRSPFioc");
+    static const char* const option[] = {
+        "--save", "--restore", "--replay", "--sync", "--publish", "--follow", "-i", "-o", "-c",
+        "-x",
+    };
+    size_t k = 0;
+    while (letter[k] != 0 && letter[k] != action)
+        ++k;
+    pOut = str_put(pOut, "action: ");
+    pOut = str_put(pOut, option[k]);
+    *pOut++ = '\n';
+    if (stats.eolScan) {
+        pOut = str_put(pOut, "eol detected: ");
+        pOut = str_put(pOut, (stats.eol == EOL_CRLF) ? "lf => crlf\n" : "keep\n");
+    }
+    for (size_t i = 0; i < n; ++i)
+        pOut = str_row(pOut, name[i], value[i]);
+
+    WriteFile(GetStdHandle(STD_ERROR_HANDLE), buf, (DWORD)(pOut - buf), &(DWORD){0}, NULL);
+}
+
+
+// histogram bucket of a value
+static size_t hist_bucket(uint64_t value)
+{
+    if (value < HIST_SUB)
+        return (size_t)value;
+
+    // value >> e is in [HIST_SUB, 2 * HIST_SUB)
+    unsigned e = 0;
+    while ((value >> e) >= 2 * HIST_SUB)
+        ++e;
+    size_t bucket = HIST_SUB * (e + 1) + (size_t)(value >> e) - HIST_SUB;
+    return (bucket < HIST_SIZE) ? bucket : HIST_SIZE - 1;
+}
+
+
+// highest value of a histogram bucket
+static uint64_t hist_value(size_t bucket)
+{
+    if (bucket < HIST_SUB)
+        return bucket;
+
+    unsigned e = (unsigned)(bucket / HIST_SUB) - 1;
+    return ((uint64_t)(bucket % HIST_SUB + HIST_SUB + 1) << e) - 1;
+}
+
+
+// percentile (in 1/1000) of n values in a histogram
+static uint64_t hist_pct(const uint32_t* hist, uint64_t n, uint32_t permille)
+{
+    uint64_t rank = (n * permille + 999) / 1000, sum = 0;
+
+    for (size_t bucket = 0; bucket < HIST_SIZE; ++bucket)
+        if ((sum += hist[bucket]) >= rank && sum > 0)
+            return hist_value(bucket);
+
+    return 0;
+}
+
+
+// copy string returning its end
+static char* str_put(char* pOut, const char* psz)
+{
+    while (*psz != 0)
+        *pOut++ = *psz++;
+    return pOut;
+}
+
+
+// "name:      value" line
+static char* str_row(char* pOut, const char* name, uint64_t value)
+{
+    char num[24], *pNum = utoa(value, num + sizeof(num));
+    char* pStart = pOut;
+
+    pOut = str_put(pOut, name);
+    *pOut++ = ':';
+    do *pOut++ = ' '; while (pOut - pStart < 24 - (num + sizeof(num) - pNum));
+    while (pNum < num + sizeof(num))
+        *pOut++ = *pNum++;
+    *pOut++ = '\n';
+
+    return pOut;
+}
+
+
+// match "name" or "name=value" returning value or NULL
+static const _TCHAR* optval(const _TCHAR* opt, const _TCHAR* name)
+{
+    while (*name != 0 && *opt == *name)
+        ++opt, ++name;
+    return (*name != 0) ? NULL : (*opt == 0) ? opt : (*opt == _T('=')) ? opt + 1 : NULL;
+}
+
+
+// command line argument => WideChar (heap)
+static WCHAR* arg_wcs(const _TCHAR* psz, size_t* pcch)
+{
+#if defined(UNICODE)
+    size_t cch = (size_t)lstrlen(psz);
+    WCHAR* pw = heap_alloc(NULL, sizeof(WCHAR) * (cch + 1));
+    mem_copy(pw, psz, sizeof(WCHAR) * (cch + 1));
+#else
+    int cchBuf = MultiByteToWideChar(CP_ACP, 0, psz, -1, NULL, 0);
+    WCHAR* pw = heap_alloc(NULL, sizeof(WCHAR) * (size_t)cchBuf);
+    MultiByteToWideChar(CP_ACP, 0, psz, -1, pw, cchBuf);
+    size_t cch = (size_t)cchBuf - 1;
+#endif // UNICODE
+    return *pcch = cch, pw;
+}
+
+
+// ENC[,lf]:PATH => *pOut
+// returns PATH or NULL if invalid
+static const _TCHAR* arg_out(const _TCHAR* psz, OUT_SPEC* pOut)
+{
+    const _TCHAR* p;
+    if ((p = arg_prefix(psz, _T("acp"))) != NULL)
+        pOut->cp = GetACP();
+    else if ((p = arg_prefix(psz, _T("oem"))) != NULL)
+        pOut->cp = GetOEMCP();
+    else if ((p = arg_prefix(psz, _T("utf8"))) != NULL)
+        pOut->cp = CP_UTF8;
+    else if ((p = arg_prefix(psz, _T("utf16"))) != NULL)
+        pOut->cp = CP_UTF16;
+    else
+        return NULL;
+
+    pOut->lf = (*p == _T(','));
+    if (pOut->lf && (p = arg_prefix(p + 1, _T("lf"))) == NULL)
+        return NULL;
+    return pOut->pszPath = (p[0] == _T(':') && p[1] != 0) ? p + 1 : NULL;
+}
+
+
+// psz past prefix or NULL if it does not start with prefix
+static const _TCHAR* arg_prefix(const _TCHAR* psz, const _TCHAR* prefix)
+{
+    while (*prefix != 0 && *psz == *prefix)
+        ++psz, ++prefix;
+    return (*prefix != 0) ? NULL : psz;
+}
+
+
+// decimal => unsigned
+static uint32_t atou(const _TCHAR* psz)
+{
+    uint32_t n = 0;
+    while (*psz >= _T('0') && *psz <= _T('9'))
+        n = n * 10 + (uint32_t)(*psz++ - _T('0'));
+    return n;
+}
+
+
+// performance counter
+static inline int64_t qpc(void)
+{
+    LARGE_INTEGER li;
+    QueryPerformanceCounter(&li);
+    return li.QuadPart;
+}
+
+
+// memory accounting
+static inline void mem_count(size_t szOld, size_t szNew)
+{
+    stats.szLive += szNew - szOld;
+    if (stats.szPeak < stats.szLive)
+        stats.szPeak = stats.szLive;
+}
+
+
+// copy accounting: stages not counted yet
+static inline void copy_count(unsigned* pDone, unsigned stages)
+{
+    for (unsigned m = stages & ~*pDone; m != 0; m &= m - 1)
+        ++stats.nCopy;
+    *pDone |= stages;
+}
+
+
+// GlobalAlloc or GlobalReAlloc unlocked *ph returning locked pointer
+static void* global_alloc(HANDLE* ph, size_t sz)
+{
+    size_t szOld = 0;
+    if (*ph == NULL) {
+        *ph = GlobalAlloc(GMEM_MOVEABLE, sz);
+    } else {
+        szOld = GlobalSize(*ph);
+        *ph = GlobalReAlloc(*ph, sz, GMEM_MOVEABLE);
+    }
+    mem_count(szOld, sz);
+    return GlobalLock(*ph);
+}
+
+static void global_free(HANDLE h)
+{
+    mem_count(GlobalSize(h), 0);
+    GlobalFree(h);
 }
 
 
 // heap allocation
 static inline void* heap_alloc(void* ptr, size_t sz)
 {
+    mem_count(ptr ? HeapSize(GetProcessHeap(), 0, ptr) : 0, sz);
     return ptr ? HeapReAlloc(GetProcessHeap(), HEAP_GENERATE_EXCEPTIONS, ptr, sz)
         : HeapAlloc(GetProcessHeap(), HEAP_GENERATE_EXCEPTIONS, sz);
 }
 
 static inline void heap_free(void* ptr)
 {
+    mem_count(HeapSize(GetProcessHeap(), 0, ptr), 0);
     HeapFree(GetProcessHeap(), 0, ptr);
 }
 
 
 // micro CRT startup code
-#if __has_include("nocrt0c.c")
+#if __has_include("nocrt0c.c") && defined(_WIN32)
 #define ARGV builtin
 #include "nocrt0c.c"
 #endif